@@ -14,29 +14,22 @@
 
 #ifndef BOOTLOADER
 
-static uint32_t alarm_timer = 0;
-
 /*
  * Set General alarm status dependent on the discret inputs
+ * (scheduler task, see CFG_SCHED_TASKS)
  */
 void do_alarms(void)
 {
-	if (get_jiffies() - alarm_timer >= 100)
+	if(((modbus_get_discrete_input(DIS_INPUT__TEMP_SENSOR_BROKEN) == 1) || \
+	(modbus_get_discrete_input(DIS_INPUT__HUMIDITY_SENSOR_BROKEN) == 1) || \
+	(modbus_get_discrete_input(DIS_INPUT__VOLTAGE_SENSOR_BROKEN) == 1) || \
+	(modbus_get_discrete_input(DIS_INPUT__CURRENT_SENSOR_BROKEN) == 1)))
+	{
+		modbus_set_discrete_input(DIS_INPUT__UNIT_GENERAL_ALARM_STATUS, 1);
+	}
+	else
 	{
-		alarm_timer = get_jiffies();
-		
-				
-		if(((modbus_get_discrete_input(DIS_INPUT__TEMP_SENSOR_BROKEN) == 1) || \
-		(modbus_get_discrete_input(DIS_INPUT__HUMIDITY_SENSOR_BROKEN) == 1) || \
-		(modbus_get_discrete_input(DIS_INPUT__VOLTAGE_SENSOR_BROKEN) == 1) || \
-		(modbus_get_discrete_input(DIS_INPUT__CURRENT_SENSOR_BROKEN) == 1)))
-		{
-			modbus_set_discrete_input(DIS_INPUT__UNIT_GENERAL_ALARM_STATUS, 1);
-		}
-		else
-		{
-			modbus_set_discrete_input(DIS_INPUT__UNIT_GENERAL_ALARM_STATUS, 0);
-		}
+		modbus_set_discrete_input(DIS_INPUT__UNIT_GENERAL_ALARM_STATUS, 0);
 	}
 }
 #endif /* BOOTLOADER */
\ No newline at end of file
@@ -22,6 +22,13 @@
 #include "modbus.h"
 #include "watchdog.h"
 #include "env.h"
+#include "sched.h"
+#include "crc.h"
+#include "rs485.h"
+#include "profile.h"
+#include "sht31.h"
+#include "curve.h"
+#include "journal.h"
 
 #define CLI_INBUF_SIZE	256
 #define CLI_MAX_ARGS	256
@@ -219,6 +226,39 @@ static int cli_cmd_printenv(int argc, char **argv)
 	return 0;
 }
 
+#ifdef CFG_PROFILE_ENABLE
+static int cli_cmd_stats(int argc, char **argv)
+{
+	struct profile_stats stats;
+	int i;
+	
+	if (argc == 1 && !strcmp(argv[0], "reset")) {
+		profile_reset();
+		return 0;
+	} else if (argc) {
+		PRINTF("Invalid arguments\r\n");
+		return -1;
+	}
+	PRINTF("Main loop: %lu passes/s, %lu%% idle\r\n", sched_get_loop_rate(), sched_get_idle_percent());
+	PRINTF("%-10s %10s %8s %8s %8s %8s\r\n", "task", "calls", "last", "min", "avg", "max");
+	for (i = 0; i < PROFILE_TASK_COUNT; i++) {
+		profile_get_stats(i, &stats);
+		PRINTF("%-10s %10lu %8lu %8lu %8lu %8lu\r\n", profile_get_name(i), stats.calls,
+			stats.last_us, stats.min_us, stats.avg_us, stats.max_us);
+	}
+	PRINTF("(times in us)\r\n");
+	
+	return 0;
+}
+
+static int cli_cmd_boot(int argc, char **argv)
+{
+	profile_boot_print();
+	
+	return 0;
+}
+#endif /* CFG_PROFILE_ENABLE */
+
 static int cli_cmd_env_reset(int argc, char **argv) {
 	env_reset();
 	/* NOTREACHED */
@@ -283,7 +323,14 @@ static int cli_cmd_eeprom_write(int argc, char **argv)
 
 static int cli_cmd_eeprom_commit(int argc, char **argv)
 {
-	eeprom_emulator_commit_page_buffer();
+	eeprom_commit();
+	
+	return 0;
+}
+
+static int cli_cmd_journal(int argc, char **argv)
+{
+	journal_print();
 	
 	return 0;
 }
@@ -461,11 +508,174 @@ static int cli_cmd_hang(int argc, char **argv)
 
 static int cli_cmd_systick(int argc, char **argv)
 {
-	PRINTF("%ld\r\n", get_jiffies());
+	uint64_t now = get_time_us();
+	
+	PRINTF("%ld (%lu.%06lu s)\r\n", get_jiffies(), (uint32_t)(now / 1000000), (uint32_t)(now % 1000000));
 	
 	return 0;
 }
 
+static int cli_cmd_rs485_stats(int argc, char **argv)
+{
+	struct rs485_stats stats;
+	
+	rs485_get_stats(&stats);
+	PRINTF("Frames sent: %lu\r\n", stats.frames);
+	PRINTF("Request end -> driver enable: %lu us (max %lu us)\r\n", stats.response_us, stats.response_max_us);
+	PRINTF("TXC interrupt -> driver release: %lu us (max %lu us, guard %d us)\r\n", stats.turnaround_us, stats.turnaround_max_us, CFG_RS485_GUARD_TIME_US);
+	
+	return 0;
+}
+
+static int cli_cmd_loop_rate(int argc, char **argv)
+{
+	PRINTF("Main loop: %lu passes/s, %lu%% idle\r\n", sched_get_loop_rate(), sched_get_idle_percent());
+	
+	return 0;
+}
+
+static int cli_cmd_modbus_stats(int argc, char **argv)
+{
+	struct modbus_stats stats;
+	
+	modbus_get_stats(&stats);
+	PRINTF("Frames received: %lu\r\n", stats.frames);
+	PRINTF("CRC errors: %lu\r\n", stats.crc_errors);
+	PRINTF("Overruns: %lu\r\n", stats.overruns);
+	PRINTF("Dropped (%d slots full): %lu\r\n", CFG_MODBUS_RX_SLOTS, stats.dropped);
+	PRINTF("Holding register pages saved: %lu\r\n", stats.saved_pages);
+	
+	return 0;
+}
+
+static int cli_cmd_i2c_stats(int argc, char **argv)
+{
+	struct i2c_stats stats;
+	struct i2c_sensor *sensor;
+	int i;
+	
+	i2c_get_stats(&stats);
+	PRINTF("Transactions: %lu (%lu errors, %lu timeouts)\r\n", stats.xfers, stats.errors, stats.timeouts);
+	PRINTF("Bus utilization: %lu%%\r\n", stats.busy_percent);
+	for (i = 0; (sensor = i2c_get_sensor(i)) != NULL; i++) {
+		PRINTF("%-10s addr 0x%02x, every %u ms: %lu samples, %lu faults\r\n", sensor->name, sensor->address,
+			sensor->period, sensor->samples, sensor->faults);
+	}
+	
+	return 0;
+}
+
+static int cli_cmd_fan_curve(int argc, char **argv)
+{
+	uint32_t curve = 0, pwm;
+	
+	if (argc > 0) {
+		curve = strtoul(argv[0], NULL, 0);
+	}
+	curve_print(curve);
+	if (argc > 1) {
+		pwm = strtoul(argv[1], NULL, 0);
+		PRINTF("%lu%% -> %u RPM\r\n", pwm, curve_rpm(curve, CURVE_PWM_Q16(pwm)));
+	}
+	
+	return 0;
+}
+
+static int cli_cmd_fans(int argc, char **argv)
+{
+	uint8_t pwm;
+	uint32_t rpm;
+	int i;
+	
+	for (i = 0; fan_get_status(i, &pwm, &rpm) == 0; i++) {
+		PRINTF("Fan %d: %3u%% PWM, %5lu RPM\r\n", i, pwm, rpm);
+	}
+	
+	return 0;
+}
+
+static int cli_cmd_sht31(int argc, char **argv)
+{
+	struct i2c_sensor *sensor = i2c_get_sensor(I2C_SENSOR_SHT31);
+	uint16_t status;
+	int ret;
+	
+	if (argc < 1 || !strcmp(argv[0], "status")) {
+		ret = sht31_diag(sensor, SHT31_CMD_READ_STATUS, &status);
+		if (ret == 0) {
+			PRINTF("Status: 0x%04x%s%s%s%s%s%s%s\r\n", status,
+				status & SHT31_STATUS_ALERT_PENDING ? " alert" : "",
+				status & SHT31_STATUS_HEATER ? " heater" : "",
+				status & SHT31_STATUS_RH_ALERT ? " rh_alert" : "",
+				status & SHT31_STATUS_T_ALERT ? " t_alert" : "",
+				status & SHT31_STATUS_RESET ? " reset" : "",
+				status & SHT31_STATUS_COMMAND_FAILED ? " command_failed" : "",
+				status & SHT31_STATUS_CHECKSUM_FAILED ? " checksum_failed" : "");
+		}
+		PRINTF("CRC errors: %lu\r\n", sht31_get_crc_errors());
+	} else if (!strcmp(argv[0], "clear")) {
+		ret = sht31_diag(sensor, SHT31_CMD_CLEAR_STATUS, NULL);
+	} else if (!strcmp(argv[0], "heater") && argc > 1) {
+		ret = sht31_diag(sensor, strcmp(argv[1], "on") ? SHT31_CMD_HEATER_DISABLE : SHT31_CMD_HEATER_ENABLE, NULL);
+	} else {
+		PRINTF("Invalid arguments\r\n");
+		return -1;
+	}
+	if (ret < 0) {
+		PRINTF("ERROR: no answer from the SHT31\r\n");
+	}
+	
+	return ret;
+}
+
+static int cli_cmd_crc_test(int argc, char **argv)
+{
+	/* Known MODBUS CRC16 test vectors */
+	static const struct {
+		const char *data;
+		uint8_t len;
+		uint16_t crc;
+	} vectors[] = {
+		{ "123456789", 9, 0x4B37 },
+		{ "\x01\x03\x00\x00\x00\x0A", 6, 0xCDC5 },
+		{ "\x11\x03\x00\x6B\x00\x03", 6, 0x8776 },
+		{ "\x01\x03\x00\x00\x00\x0A\xC5\xCD", 8, 0x0000 },
+	};
+	uint8_t buf[256];
+	uint32_t start, elapsed;
+	uint16_t crc;
+	int i, ret = 0;
+	
+	PRINTF("MODBUS CRC16 implementation: %d-entry table\r\n", CFG_MODBUS_CRC16_TABLE_SIZE);
+	for (i = 0; i < (int)(sizeof(vectors)/sizeof(*vectors)); i++) {
+		crc = modbus_crc16((const uint8_t *)vectors[i].data, vectors[i].len);
+		PRINTF("Vector %d: 0x%04x (expected 0x%04x) %s\r\n", i, crc, vectors[i].crc, crc == vectors[i].crc ? "OK" : "FAILED");
+		if (crc != vectors[i].crc) {
+			ret = -1;
+		}
+	}
+	
+	for (i = 0; i < (int)sizeof(buf); i++) {
+		buf[i] = i;
+	}
+	start = get_jiffies();
+	for (i = 0; i < 200; i++) {
+		modbus_crc16(buf, sizeof(buf));
+		WDT_RESET;
+	}
+	elapsed = get_jiffies() - start;
+	PRINTF("256-byte frame: %lu us\r\n", elapsed*1000/200);
+	
+	/* SHT31 data CRC8 (datasheet example) */
+	crc = crc8(0xFF, (const uint8_t *)"\xBE\xEF", 2, 0x31);
+	PRINTF("CRC8 0xBEEF: 0x%02x (expected 0x92) %s\r\n", crc, crc == 0x92 ? "OK" : "FAILED");
+	if (crc != 0x92) {
+		ret = -1;
+	}
+	
+	return ret;
+}
+
 
 #endif /* CFG_DEVEL_COMMANDS_ENABLE */
 
@@ -537,6 +747,20 @@ static struct cli_cmd_entry cli_cmd_switch[] = {
 		"Reset to default environment",
 		cli_cmd_env_reset
 	},
+#ifdef CFG_PROFILE_ENABLE
+	{
+		"stats",
+		"[reset]",
+		"Show main loop task execution times (or reset them)",
+		cli_cmd_stats
+	},
+	{
+		"boot",
+		"",
+		"Show the boot phase times, up to the first MODBUS response",
+		cli_cmd_boot
+	},
+#endif /* CFG_PROFILE_ENABLE */
 	
 	
 #ifdef CFG_DEVEL_COMMANDS_ENABLE
@@ -552,6 +776,12 @@ static struct cli_cmd_entry cli_cmd_switch[] = {
 		"Write to emulated EEPROM",
 		cli_cmd_eeprom_write
 	},
+	{
+		"journal",
+		"",
+		"Show the counter journal in the SPI Flash",
+		cli_cmd_journal
+	},
 	{
 		"eeprom_commit",
 		"",
@@ -564,6 +794,54 @@ static struct cli_cmd_entry cli_cmd_switch[] = {
 		"Get current system timer counter",
 		cli_cmd_systick
 	},
+	{
+		"rs485_stats",
+		"",
+		"Show RS-485 bus turnaround statistics",
+		cli_cmd_rs485_stats
+	},
+	{
+		"loop_rate",
+		"",
+		"Show the number of scheduler passes per second and the idle time",
+		cli_cmd_loop_rate
+	},
+	{
+		"modbus_stats",
+		"",
+		"Show MODBUS receive statistics",
+		cli_cmd_modbus_stats
+	},
+	{
+		"fan_curve",
+		"[curve [pwm]]",
+		"Show a fan curve (and the RPM expected at a PWM)",
+		cli_cmd_fan_curve
+	},
+	{
+		"fans",
+		"",
+		"Show the PWM and speed of each fan channel",
+		cli_cmd_fans
+	},
+	{
+		"sht31",
+		"[status | clear | heater on|off]",
+		"SHT31 diagnostics: status register, heater",
+		cli_cmd_sht31
+	},
+	{
+		"i2c_stats",
+		"",
+		"Show I2C bus utilization and sensor statistics",
+		cli_cmd_i2c_stats
+	},
+	{
+		"crc_test",
+		"",
+		"Check the MODBUS CRC16 and the CRC8 against test vectors and measure the CRC16 speed",
+		cli_cmd_crc_test
+	},
 	{
 		"flash_read",
 		"addr, len",
@@ -638,7 +916,7 @@ static int cli_cmd_help(int argc, char **argv)
 			PRINTF("Command not supported: %s\r\n", argv[0]);
 		}
 	} else {
-		if(env_get("hide_cli_commands") == 0)
+		if(env_get_idx(ENV_HIDE_CLI_COMMANDS) == 0)
 		{
 			PRINTF("Supported commands:\r\n");
 			for (cmd = 0; cmd < CLI_COMMANDS; cmd++) {
@@ -720,17 +998,9 @@ static void cli_upgrade_parse(char *buf)
 	}
 }
 
-void do_cli(void)
+/* Process one received character */
+static void cli_process_char(char c)
 {
-	char c;
-	
-	if (prompt && !upgrade_mode) {
-		uart_puts(CFG_CONSOLE_CHANNEL, CLI_PROMPT);
-		prompt = 0;
-	}
-	if (!uart_gets(CFG_CONSOLE_CHANNEL, &c, 1)) {
-		return;
-	}
 	if (c == '\n') {
 		/* Do nothing: see '\r' below */
 	} else if (c == '\r') {
@@ -764,4 +1034,23 @@ void do_cli(void)
 	}
 }
 
+/* Scheduler task: woken when console input arrives */
+void do_cli(void)
+{
+	char c;
+	
+	/* Handle everything received since the last run */
+	do {
+		if (prompt && !upgrade_mode) {
+			uart_puts(CFG_CONSOLE_CHANNEL, CLI_PROMPT);
+			prompt = 0;
+		}
+		if (!uart_gets(CFG_CONSOLE_CHANNEL, &c, 1)) {
+			return;
+		}
+		cli_process_char(c);
+		WDT_RESET;
+	} while (1);
+}
+
 #endif /* BOOTLOADER */
\ No newline at end of file
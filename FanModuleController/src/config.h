@@ -40,6 +40,10 @@
 /* Enable development and debugging commands */
 #define CFG_DEVEL_COMMANDS_ENABLE
 
+/* Enable the main loop profiler (CLI "stats", MODBUS input registers 0x40+) */
+#define CFG_PROFILE_ENABLE
+#define CFG_PROFILE_BOOT_PHASES		12	/* Boot phases recorded for CLI "boot" */
+
 /* Firmware */
 #define CFG_FIRMWARE_NUMBER			"63998290" 
 #define CFG_FIRMWARE_VERSION		"51"
@@ -47,6 +51,25 @@
 #define CFG_DEVICE_NAME				"Fan Module"
 
 
+/*
+ * Main loop tasks, run by the cooperative scheduler (sched.c):
+ *
+ * CFG_SCHED_TASK(index, name, call, period_ms)
+ *
+ * Tasks are listed by decreasing priority. A task runs when its period has
+ * elapsed or when it has been woken by sched_wake() (period 0: only when woken).
+ */
+#define CFG_SCHED_TASKS				CFG_SCHED_TASK(SCHED_MODBUS, "modbus", do_modbus(), 100)\
+									CFG_SCHED_TASK(SCHED_CLI, "cli", do_cli(), 100)\
+									CFG_SCHED_TASK(SCHED_FAN, "fan", do_fan(), CFG_FAN_TASK_PERIOD)\
+									CFG_SCHED_TASK(SCHED_ALARMS, "alarms", do_alarms(), 100)\
+									CFG_SCHED_TASK(SCHED_LED, "led", do_led(), 125)\
+									CFG_SCHED_TASK(SCHED_I2C_LOCAL, "i2c_local", do_i2c_local(), 10)\
+									CFG_SCHED_TASK(SCHED_ENV, "env", do_env(), 100)\
+									CFG_SCHED_TASK(SCHED_HEARTBEAT, "heartbeat", do_heartbeat(1), 500)\
+									CFG_SCHED_TASK(SCHED_PROFILE, "profile", do_profile(), 1000)
+
+
 /* LEDs */
 #define CFG_HEARTBEAT_LED			PIN_PB30
 #define CFG_LED_GREEN				PIN_PB00
@@ -59,6 +82,7 @@
  * CFG_UART_CHANNEL(channel, SERCOMx, baud_rate, parity, mux_setting, pinmux_pad0, pinmux_pad1, pinmux_pad2, pinmux_pad3)
  */
 #define CFG_UART_RING_SIZE			1024
+#define CFG_UART_TX_RING_SIZE		512
 #ifdef BOOTLOADER
 #define CFG_UART_CHANNELS			CFG_UART_CHANNEL(0, SERCOM3, CFG_CONSOLE_BAUD_RATE, USART_PARITY_NONE, USART_RX_3_TX_2_XCK_3, PINMUX_UNUSED, PINMUX_UNUSED, PINMUX_PA24C_SERCOM3_PAD2, PINMUX_PA25C_SERCOM3_PAD3)
 #else
@@ -80,10 +104,19 @@
 #define CFG_MODBUS_ADDRESS_4		PIN_PB04
 #define CFG_MODBUS_RE_PIN			PIN_PA12
 #define CFG_MODBUS_DE_PIN			PIN_PA13
+#define CFG_RS485_GUARD_TIME_US		0		/* Extra driver hold time after the last stop bit */
+#define CFG_RS485_GUARD_TC_MODULE	TC3		/* Times the guard (only used if CFG_RS485_GUARD_TIME_US > 0) */
 #define CFG_MODBUS_TC_MODULE		TC2
 #define CFG_MODBUS_DISCRETE_INPUTS	0xD0 
-#define CFG_MODBUS_INPUT_REGS		0x40
+#define CFG_MODBUS_INPUT_REGS		0x69	/* Up to the last profiled task (checked in profile.c) */
 #define CFG_MODBUS_HOLDING_REGS		0x90
+#define CFG_MODBUS_HOLDING_LAYOUT	1		/* Raise when holding registers are added (stored in env holding_layout) */
+#define CFG_MODBUS_RX_SLOTS			2		/* Received frames queued while the main loop is busy */
+#define CFG_MODBUS_SAVE_IDLE		500		/* ms without holding register writes before saving them to the EEPROM */
+#define CFG_MODBUS_SAVE_MAX_DELAY	5000	/* ms: save even if the master keeps writing */
+#ifndef CFG_MODBUS_CRC16_TABLE_SIZE			/* Overridden by the host tests (test/Makefile) */
+#define CFG_MODBUS_CRC16_TABLE_SIZE	256		/* 256 (fastest), 16 (compact) or 0 (bitwise, no table) */
+#endif
 
 
 /* Reset values of MODBUS holding registers */
@@ -99,6 +132,13 @@
 #define CFG_MODBUS_HLD_MODBUS_DEAD_TIME			30
 #define CFG_MODBUS_HLD_SOFTWARE_RESET			0
 #define CFG_MODBUS_HLD_UPGRADE_FUNCTION			0
+#define CFG_MODBUS_HLD_FAN_CONTROL_MODE			0		/* FAN_CONTROL_MODE_PWM */
+#define CFG_MODBUS_HLD_FAN_RPM_REQUEST			0
+#define CFG_MODBUS_HLD_FAN_PID_KP				1311	/* 0.02 %PWM per RPM */
+#define CFG_MODBUS_HLD_FAN_PID_KI				3277	/* 0.05 %PWM per RPM*s */
+#define CFG_MODBUS_HLD_FAN_PID_KD				0
+#define CFG_MODBUS_HLD_INA226_AVERAGING			256
+#define CFG_MODBUS_HLD_INA226_CONVERSION_TIME	1100	/* us: 256 x 2 x 1.1 ms = 563 ms per reading */
 
 /* SPI Flash configuration */
 #define CFG_SPI_FLASH_SS_PIN		PIN_PA05
@@ -108,26 +148,65 @@
 #define CFG_SPI_FLASH_PINMUX_PAD1	PINMUX_PA05D_SERCOM0_PAD1
 #define CFG_SPI_FLASH_PINMUX_PAD2	PINMUX_PA06D_SERCOM0_PAD2
 #define CFG_SPI_FLASH_PINMUX_PAD3	PINMUX_PA07D_SERCOM0_PAD3
+#define CFG_JOURNAL_OFFSET			0xE0000		/* Counter journal (journal.c): last blocks, kept by the upgrade */
+#define CFG_JOURNAL_BLOCKS			2
 
 /* I2C configuration */
 #define CFG_I2C_MODULE					SERCOM1
 #define CFG_I2C_SERCOM_PINMUX_PAD0		PINMUX_PA16C_SERCOM1_PAD0
 #define CFG_I2C_SERCOM_PINMUX_PAD1		PINMUX_PA17C_SERCOM1_PAD1
-#define CFG_I2C_MASTER_TIMEOUT			5
+#define CFG_I2C_MASTER_TIMEOUT			5		/* ms per transaction */
+
+/*
+ * I2C sensors, sampled by the I2C task (i2c_local.c):
+ *
+ * CFG_I2C_SENSOR(index, name, driver, i2c_address, period_ms, input_reg, aux_input_reg, discrete_input)
+ *
+ * The driver publishes its readings in the MODBUS input registers from
+ * input_reg (and from aux_input_reg, if it has further readings: INA226
+ * power) and its "sensor broken" flags in the discrete inputs from
+ * discrete_input (see the driver source for the layout).
+ */
+#define CFG_I2C_SENSORS				CFG_I2C_SENSOR(I2C_SENSOR_INA226, "ina226", ina226_driver, CFG_I2C_ADDRESS_INA226, 1000, INPUT_REG__VOLTAGE_SENSOR_SPEED_3_2, INPUT_REG__POWER_SENSOR_3_2, DIS_INPUT__VOLTAGE_SENSOR_BROKEN)\
+									CFG_I2C_SENSOR(I2C_SENSOR_SHT31, "sht31", sht31_driver, CFG_I2C_ADDRESS_T_H, 1000, INPUT_REG__TEMP_SENSOR, 0, DIS_INPUT__TEMP_SENSOR_BROKEN)
 #define CFG_I2C_ADDRESS_INA226			0x40
 #define CFG_I2C_ADDRESS_T_H				0x44
 
+/* Sensor calibration (fixp.h): value = raw * NUM / DEN + OFFSET */
+#define CFG_INA226_CURRENT_NUM			5		/* mA: 2.5 uV/LSB over a 1 mOhm shunt */
+#define CFG_INA226_CURRENT_DEN			2
+#define CFG_INA226_VOLTAGE_NUM			1250	/* mV: 1.25 mV/LSB over the 0.213 input divider */
+#define CFG_INA226_VOLTAGE_DEN			213		/* (theoretically 0.21541318, but there is an offset) */
+#define CFG_INA226_CALIBRATION			2048	/* 0.00512 / (2.5 mA * 1 mOhm): current LSB = shunt LSB */
+#define CFG_INA226_POWER_NUM			62500	/* mW: 25 x 2.5 mA x 1.25 mV/LSB over the input divider */
+#define CFG_INA226_POWER_DEN			213
+#define CFG_SHT31_TEMP_NUM				17500	/* 0.01 degC: -45 + 175 * raw / (2^16 - 1) */
+#define CFG_SHT31_TEMP_DEN				65535
+#define CFG_SHT31_TEMP_OFFSET			-4500
+#define CFG_SHT31_HUM_NUM				10000	/* 0.01 %RH: 100 * raw / (2^16 - 1) */
+#define CFG_SHT31_HUM_DEN				65535
+#define CFG_SHT31_MODE					SHT31_MODE_PERIODIC_2_MPS	/* sht31.h: faster than the sample rate */
+
+/*
+ * Fan channels: one PWM output and one tacho input each
+ * CFG_FAN_CHANNEL(index, PWM TC, PWM channel, PWM pin, PWM mux, tacho TC, tacho TC event user,
+ *                 EXTINT line, tacho pin, tacho mux, EVSYS channel)
+ * Fans on the same PWM TC share its frequency. Fan 0 uses the original
+ * MODBUS registers, the other fans the HOLD_REG__FAN_BLOCK / INPUT_REG__FAN_BLOCK
+ * blocks (modbus.h). Each tacho needs its own TC, EXTINT line and EVSYS channel.
+ */
+#define CFG_FAN_CHANNELS				CFG_FAN_CHANNEL(0, TC1, 0, PIN_PA10E_TC1_WO0, MUX_PA10E_TC1_WO0, TC4, EVSYS_ID_USER_TC4_EVU, 0, PIN_PB16A_EIC_EXTINT0, MUX_PB16A_EIC_EXTINT0, 0)
+/* Second fan, e.g.: CFG_FAN_CHANNEL(1, TC1, 1, PIN_PA11E_TC1_WO1, MUX_PA11E_TC1_WO1, TC5, EVSYS_ID_USER_TC5_EVU, 1, PIN_PB17A_EIC_EXTINT1, MUX_PB17A_EIC_EXTINT1, 1) */
+
 /* Fan configuration */
-#define CFG_PWM_MODULE					TC1
 #define CFG_PWM_FREQUENCY				5000
-#define CFG_PWM1_PIN					PIN_PA10E_TC1_WO0
-#define CFG_PWM1_MUX					MUX_PA10E_TC1_WO0
 #define CFG_PWM_INITIAL_VALUE			0		
+#define CFG_FAN_TASK_PERIOD				100		/* ms, must divide the fan timings (100 ms) */
+#define CFG_FAN_CURVES					4		/* Curves in HOLD_REG__FAN_CURVES (one per fan type) */
+#define CFG_FAN_CURVE_POINTS			12		/* Breakpoints per curve */
 
-#define	CFG_INT0_PIN_FAN1				PIN_PB16A_EIC_EXTINT0
-#define	CFG_INT0_MUX_FAN1				MUX_PB16A_EIC_EXTINT0
-
-#define CFG_TACHO_MODULE				TC4
+#define CFG_TACHO_CAPTURE_ENABLE						/* Period capture via EVSYS (undefine: 1 s gated edge count, fan 0 only) */
+#define CFG_FAN_PID_ENABLE								/* Closed-loop RPM control (HOLD_REG__FAN_CONTROL_MODE), needs the capture */
 #define CFG_CONVERTER_OFF				PIN_PA28
 
 /* Dip-Switch */
@@ -140,18 +219,27 @@
 #define CFG_FIRST_START_DONE			0
 #define CFG_HIDE_CLI_COMMANDS			0
 #define CFG_DISABLE_UPDATE_ABILITY		0
+#define CFG_FAN_CURVE_FORMAT			0		/* 0: 101-point table of older firmware, converted at start-up */
+#define CFG_HOLDING_LAYOUT				0		/* 0: baseline holding registers, the newer ones are initialized at start-up */
 #define CFG_RESET_SHT31					PIN_PA27
 
 /*
  * Non-volatile (persistent) configuration parameters:
  *
- * CFG_ENV_DESC(name, default_value)
+ * CFG_ENV_DESC(index, name, type, default_value, min, max, apply)
+ *
+ * The index (enum env_idx) is used by the firmware, the name by the CLI.
+ * Values outside min..max are rejected; apply (or NULL) is called when
+ * the value changes: void apply(enum env_idx idx, uint32_t val).
+ * Append new variables at the end (older saved environments get the defaults).
  */
 
-#define CFG_ENV_DESCRIPTORS			CFG_ENV_DESC("modbus_baud_rate", CFG_MODBUS_BAUD_RATE)\
-									CFG_ENV_DESC("modbus_slave_addr", CFG_MODBUS_SLAVE_ADDRESS)\
-									CFG_ENV_DESC("first_start_done", CFG_FIRST_START_DONE)\
-									CFG_ENV_DESC("hide_cli_commands", CFG_HIDE_CLI_COMMANDS)\
-									CFG_ENV_DESC("disable_update_ability", CFG_DISABLE_UPDATE_ABILITY)
-								
+#define CFG_ENV_DESCRIPTORS			CFG_ENV_DESC(ENV_MODBUS_BAUD_RATE, "modbus_baud_rate", ENV_TYPE_UINT, CFG_MODBUS_BAUD_RATE, 1200, 115200, modbus_env_apply)\
+									CFG_ENV_DESC(ENV_MODBUS_SLAVE_ADDR, "modbus_slave_addr", ENV_TYPE_UINT, CFG_MODBUS_SLAVE_ADDRESS, 1, 247 - 15, modbus_env_apply)\
+									CFG_ENV_DESC(ENV_FIRST_START_DONE, "first_start_done", ENV_TYPE_BOOL, CFG_FIRST_START_DONE, 0, 1, NULL)\
+									CFG_ENV_DESC(ENV_HIDE_CLI_COMMANDS, "hide_cli_commands", ENV_TYPE_BOOL, CFG_HIDE_CLI_COMMANDS, 0, 1, NULL)\
+									CFG_ENV_DESC(ENV_DISABLE_UPDATE_ABILITY, "disable_update_ability", ENV_TYPE_BOOL, CFG_DISABLE_UPDATE_ABILITY, 0, 1, modbus_env_apply)\
+									CFG_ENV_DESC(ENV_FAN_CURVE_FORMAT, "fan_curve_format", ENV_TYPE_UINT, CFG_FAN_CURVE_FORMAT, 0, 1, NULL)\
+									CFG_ENV_DESC(ENV_HOLDING_LAYOUT, "holding_layout", ENV_TYPE_UINT, CFG_HOLDING_LAYOUT, 0, CFG_MODBUS_HOLDING_LAYOUT, NULL)
+									
 #endif /* __CONFIG_H__ */
\ No newline at end of file
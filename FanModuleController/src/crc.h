@@ -9,6 +9,12 @@
 #ifndef CRC_H_
 #define CRC_H_
 
+#define MODBUS_CRC16_INIT	0xFFFF
+
+uint8_t crc8(uint8_t crc, const uint8_t *buf, uint32_t len, uint8_t polynomial);
 uint16_t crc16(uint16_t crc, const uint8_t *buf, uint32_t len, uint16_t polynomial);
+uint16_t modbus_crc16_byte(uint16_t crc, uint8_t c);
+uint16_t modbus_crc16_update(uint16_t crc, const uint8_t *buf, uint32_t len);
+uint16_t modbus_crc16(const uint8_t *buf, uint32_t len);
 
 #endif /* CRC_H_ */
\ No newline at end of file
@@ -0,0 +1,273 @@
+/*
+ * curve.c: fan curves (piecewise linear RPM over PWM)
+ *
+ * Created: 10/16/2026 6:10:37 PM
+ *  Author: E1210640
+ *
+ * Up to CFG_FAN_CURVES curves of at most CFG_FAN_CURVE_POINTS breakpoints
+ * are stored in the holding registers from HOLD_REG__FAN_CURVES, so a
+ * curve can be uploaded with one multi-register write. Each fan selects
+ * its curve (fan type). The curves are validated and cached with the
+ * slopes of their segments (Q16), so that lookups need no division: a
+ * binary search for the segment, then one multiplication.
+ */ 
+
+#include <asf.h>
+#include <string.h>
+
+#include "config.h"
+#include "modbus.h"
+#include "uart.h"
+#include "env.h"
+#include "curve.h"
+
+#ifndef BOOTLOADER
+
+#define Q16(_x)		((uint32_t)(_x) << 16)
+
+#if FAN_CURVE_SIZE * CFG_FAN_CURVES > HOLD_REG__FAN_CURVES_END - HOLD_REG__FAN_CURVES + 1
+#error "The fan curves do not fit in the holding registers"
+#endif
+
+/* Cached curve */
+struct fan_curve {
+	uint8_t points;								/* 0: no valid curve */
+	uint8_t pwm[CFG_FAN_CURVE_POINTS];			/* % */
+	uint16_t rpm[CFG_FAN_CURVE_POINTS];
+	uint32_t rpm_slope[CFG_FAN_CURVE_POINTS];	/* RPM per % (Q16) from point i to i+1 */
+	uint32_t pwm_slope[CFG_FAN_CURVE_POINTS];	/* % per RPM (Q16) from point i to i+1 */
+};
+
+static struct fan_curve fan_curves[CFG_FAN_CURVES];
+static int curve_errors[CFG_FAN_CURVES];
+static uint16_t curve_seq;						/* Holding register version of the cached curves */
+static uint8_t curve_loaded;
+
+/* Check a curve in holding register layout: returns 0 or FAN_CURVE_ERR_xxx */
+int curve_validate(const uint16_t *regs)
+{
+	uint16_t points = regs[0];
+	int i;
+	
+	if (points < 2 || points > CFG_FAN_CURVE_POINTS) {
+		return FAN_CURVE_ERR_POINTS;
+	}
+	for (i = 0; i < points; i++) {
+		if (regs[1 + 2*i] > 100 || (i && regs[1 + 2*i] <= regs[2*i - 1])) {
+			return FAN_CURVE_ERR_PWM;
+		}
+		if (i && regs[2 + 2*i] < regs[2*i]) {
+			return FAN_CURVE_ERR_RPM;
+		}
+	}
+	
+	return 0;
+}
+
+/* Snapshot curve n from the holding registers (consistent with a multi-register write) */
+static void curve_read(int n, uint16_t *regs)
+{
+	uint8_t buf[2*FAN_CURVE_SIZE];
+	int i;
+	
+	modbus_read_holding_regs(FAN_CURVE_REG(n), FAN_CURVE_SIZE, buf);
+	for (i = 0; i < FAN_CURVE_SIZE; i++) {
+		regs[i] = (buf[2*i] << 8) | buf[2*i + 1];
+	}
+}
+
+/* Validate curve n and precompute its slopes */
+static void curve_load(int n)
+{
+	uint16_t regs[FAN_CURVE_SIZE];
+	struct fan_curve curve;
+	int i, error;
+	
+	memset(&curve, 0, sizeof(curve));
+	curve_read(n, regs);
+	error = curve_validate(regs);
+	if (error == 0) {
+		curve.points = regs[0];
+		for (i = 0; i < curve.points; i++) {
+			curve.pwm[i] = regs[1 + 2*i];
+			curve.rpm[i] = regs[2 + 2*i];
+		}
+		for (i = 0; i < curve.points - 1; i++) {
+			curve.rpm_slope[i] = Q16(curve.rpm[i+1] - curve.rpm[i]) / (curve.pwm[i+1] - curve.pwm[i]);
+			if (curve.rpm[i+1] != curve.rpm[i]) {
+				curve.pwm_slope[i] = Q16(curve.pwm[i+1] - curve.pwm[i]) / (curve.rpm[i+1] - curve.rpm[i]);
+			}
+		}
+	}
+	if (curve_loaded && error != curve_errors[n]) {
+		if (error) {
+			PRINTF("FAN: curve %d is invalid (error %d)\r\n", n, error);
+		} else {
+			PRINTF("FAN: curve %d loaded (%u points)\r\n", n, curve.points);
+		}
+	}
+	
+	/* The legacy tacho gate reads the curves in interrupt context */
+	system_interrupt_enter_critical_section();
+	fan_curves[n] = curve;
+	system_interrupt_leave_critical_section();
+	curve_errors[n] = error;
+}
+
+static void curve_load_all(void)
+{
+	int n;
+	
+	for (n = 0; n < CFG_FAN_CURVES; n++) {
+		curve_load(n);
+	}
+	curve_loaded = 1;
+}
+
+/*
+ * Convert the 101-entry table of previous firmware versions (RPM at
+ * every PWM %) into 11 breakpoints (every 10 %) of curve 0. The old
+ * lookup tolerated dips in the table; the RPMs are clamped so that they
+ * never decrease, as curve_validate() requires.
+ */
+static void curve_convert_legacy(void)
+{
+	uint16_t legacy[101], regs[FAN_CURVE_SIZE];
+	uint8_t buf[2*(HOLD_REG__FAN_CURVES_END - HOLD_REG__FAN_CURVES + 1)];
+	int i;
+	
+	for (i = 0; i <= 100; i++) {
+		legacy[i] = modbus_get_holding_reg(HOLD_REG__FAN_CURVES + i);
+	}
+	memset(regs, 0, sizeof(regs));
+	regs[0] = 11;
+	for (i = 0; i <= 10; i++) {
+		regs[1 + 2*i] = 10*i;
+		regs[2 + 2*i] = (i && legacy[10*i] < regs[2*i]) ? regs[2*i] : legacy[10*i];
+	}
+	if (curve_validate(regs) != 0) {
+		PRINTF("FAN: WARNING: the converted curve is invalid (error %d)\r\n", curve_validate(regs));
+	}
+	memset(buf, 0, sizeof(buf));
+	for (i = 0; i < FAN_CURVE_SIZE; i++) {
+		buf[2*i] = regs[i] >> 8;
+		buf[2*i + 1] = regs[i] & 0xFF;
+	}
+	modbus_write_holding_regs(HOLD_REG__FAN_CURVES, sizeof(buf)/2, buf);
+	PRINTF("FAN: converted the 101-point curve to breakpoints\r\n");
+}
+
+void curve_init(void)
+{
+	uint16_t regs[FAN_CURVE_SIZE];
+	
+	if (env_get_idx(ENV_FAN_CURVE_FORMAT) == 0) {
+		curve_read(0, regs);
+		if (curve_validate(regs) != 0) {
+			curve_convert_legacy();
+			/* Saved before the flag: a power cut in between must not leave the legacy table */
+			modbus_save_holding_regs();
+		}
+		env_set_idx(ENV_FAN_CURVE_FORMAT, 1);
+	}
+	curve_seq = modbus_get_holding_seq();
+	curve_load_all();
+}
+
+/* Reload the curves if the holding registers changed (main loop only) */
+void curve_update(void)
+{
+	uint16_t seq = modbus_get_holding_seq();
+	
+	if (seq != curve_seq) {
+		curve_seq = seq;
+		curve_load_all();
+	}
+}
+
+/* 0, or the FAN_CURVE_ERR_xxx of curve n */
+int curve_get_error(unsigned int n)
+{
+	return n < CFG_FAN_CURVES ? curve_errors[n] : FAN_CURVE_ERR_POINTS;
+}
+
+/* Expected RPM on curve n at a PWM (Q16 %); 0 without a valid curve */
+uint16_t curve_rpm(unsigned int n, uint32_t pwm_q16)
+{
+	const struct fan_curve *fan_curve;
+	int lo = 0, hi, mid;
+	
+	if (n >= CFG_FAN_CURVES || !fan_curves[n].points) {
+		return 0;
+	}
+	fan_curve = &fan_curves[n];
+	hi = fan_curve->points - 1;
+	if (pwm_q16 <= CURVE_PWM_Q16(fan_curve->pwm[0])) {
+		return fan_curve->rpm[0];
+	}
+	if (pwm_q16 >= CURVE_PWM_Q16(fan_curve->pwm[hi])) {
+		return fan_curve->rpm[hi];
+	}
+	/* Segment lo..lo+1 containing pwm */
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (pwm_q16 < CURVE_PWM_Q16(fan_curve->pwm[mid])) {
+			hi = mid;
+		} else {
+			lo = mid;
+		}
+	}
+	
+	return fan_curve->rpm[lo] + (uint16_t)(((uint64_t)(pwm_q16 - CURVE_PWM_Q16(fan_curve->pwm[lo])) * fan_curve->rpm_slope[lo]) >> 32);
+}
+
+/* PWM (Q16 %) expected to give an RPM on curve n; 0 without a valid curve */
+uint32_t curve_pwm(unsigned int n, uint16_t rpm)
+{
+	const struct fan_curve *fan_curve;
+	int lo = 0, hi, mid;
+	
+	if (n >= CFG_FAN_CURVES || !fan_curves[n].points) {
+		return 0;
+	}
+	fan_curve = &fan_curves[n];
+	hi = fan_curve->points - 1;
+	if (rpm <= fan_curve->rpm[0]) {
+		return CURVE_PWM_Q16(fan_curve->pwm[0]);
+	}
+	if (rpm >= fan_curve->rpm[hi]) {
+		return CURVE_PWM_Q16(fan_curve->pwm[hi]);
+	}
+	/* Segment lo..lo+1 with rpm[lo] < rpm <= rpm[lo+1] (never flat) */
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (rpm <= fan_curve->rpm[mid]) {
+			hi = mid;
+		} else {
+			lo = mid;
+		}
+	}
+	
+	return CURVE_PWM_Q16(fan_curve->pwm[lo]) + (rpm - fan_curve->rpm[lo]) * fan_curve->pwm_slope[lo];
+}
+
+void curve_print(unsigned int n)
+{
+	int i;
+	
+	PRINTF("Curve %u: ", n);
+	if (n >= CFG_FAN_CURVES) {
+		PRINTF("no such curve\r\n");
+		return;
+	}
+	if (curve_errors[n]) {
+		PRINTF("invalid (error %d)\r\n", curve_errors[n]);
+		return;
+	}
+	PRINTF("%u points\r\n", fan_curves[n].points);
+	for (i = 0; i < fan_curves[n].points; i++) {
+		PRINTF("%3u%% %5u RPM\r\n", fan_curves[n].pwm[i], fan_curves[n].rpm[i]);
+	}
+}
+
+#endif /* BOOTLOADER */
\ No newline at end of file
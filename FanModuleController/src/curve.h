@@ -0,0 +1,34 @@
+/*
+ * curve.h: fan curves (piecewise linear RPM over PWM)
+ *
+ * Created: 10/16/2026 6:10:37 PM
+ *  Author: E1210640
+ */ 
+
+
+#ifndef CURVE_H_
+#define CURVE_H_
+
+#include "config.h"
+
+/* Curve n in the holding registers: number of points, then (PWM %, RPM) pairs */
+#define FAN_CURVE_SIZE				(1 + 2*CFG_FAN_CURVE_POINTS)
+#define FAN_CURVE_REG(_n)			(HOLD_REG__FAN_CURVES + (_n)*FAN_CURVE_SIZE)
+
+/* PWM (%) in the Q16 format of curve_rpm()/curve_pwm() */
+#define CURVE_PWM_Q16(_pwm)			((uint32_t)(_pwm) << 16)
+
+/* curve_validate() errors */
+#define FAN_CURVE_ERR_POINTS		-1		/* Number of points not in 2..CFG_FAN_CURVE_POINTS */
+#define FAN_CURVE_ERR_PWM			-2		/* PWM above 100 % or not increasing */
+#define FAN_CURVE_ERR_RPM			-3		/* RPM decreasing */
+
+void curve_init(void);
+void curve_update(void);
+int curve_validate(const uint16_t *regs);
+int curve_get_error(unsigned int n);
+uint16_t curve_rpm(unsigned int n, uint32_t pwm_q16);
+uint32_t curve_pwm(unsigned int n, uint16_t rpm);
+void curve_print(unsigned int n);
+
+#endif /* CURVE_H_ */
\ No newline at end of file
@@ -14,12 +14,43 @@
 #if defined(CFG_EEPROM_ENABLE) && !defined(BOOTLOADER)
 
 static uint8_t eeprom_valid;
+static volatile uint8_t eeprom_busy;			/* Emulator call in progress in the main loop */
+static volatile uint8_t eeprom_commit_pending;	/* Commit requested by an interrupt meanwhile */
+
+/*
+ * The emulator is not re-entrant: an interrupt must not commit the page
+ * buffer in the middle of a row write. The commit is then done by the
+ * interrupted call, as soon as it is finished.
+ */
+static void eeprom_begin(void)
+{
+	eeprom_busy = 1;
+}
+
+static void eeprom_end(void)
+{
+	eeprom_busy = 0;
+	if (eeprom_commit_pending) {
+		eeprom_commit_pending = 0;
+		eeprom_emulator_commit_page_buffer();
+	}
+}
+
+/* Commit the page buffer from interrupt context (brown-out, watchdog early warning) */
+void eeprom_commit_from_isr(void)
+{
+	if (eeprom_busy) {
+		eeprom_commit_pending = 1;
+	} else {
+		eeprom_emulator_commit_page_buffer();
+	}
+}
 
 void SYSCTRL_Handler(void)
 {
 	if (SYSCTRL->INTFLAG.reg & SYSCTRL_INTFLAG_BOD33DET) {
 		SYSCTRL->INTFLAG.reg |= SYSCTRL_INTFLAG_BOD33DET;
-		eeprom_emulator_commit_page_buffer();
+		eeprom_commit_from_isr();
 	}
 }
 
@@ -54,10 +85,15 @@ void eeprom_init(void)
 
 int eeprom_read(uint8_t *buf, int offset, int len)
 {
+	enum status_code status;
+	
 	if (!eeprom_valid) {
 		return -1;
 	}
-	if (eeprom_emulator_read_buffer(offset, buf, len) != STATUS_OK) {
+	eeprom_begin();
+	status = eeprom_emulator_read_buffer(offset, buf, len);
+	eeprom_end();
+	if (status != STATUS_OK) {
 		return -1;
 	}
 	
@@ -66,18 +102,33 @@ int eeprom_read(uint8_t *buf, int offset, int len)
 
 int eeprom_write(const uint8_t *buf, int offset, int len)
 {
+	enum status_code status;
+	
 	if (!eeprom_valid) {
 		return -1;
 	}
-	if (eeprom_emulator_write_buffer(offset, buf, len) != STATUS_OK) {
-		return -1;
-	}
-	if (offset < CFG_EEPROM_HOLDING_OFFSET || offset >= CFG_EEPROM_HOLDING_OFFSET + 5*EEPROM_PAGE_SIZE) {
+	eeprom_begin();
+	status = eeprom_emulator_write_buffer(offset, buf, len);
+	if (status == STATUS_OK && (offset < CFG_EEPROM_HOLDING_OFFSET || offset >= CFG_EEPROM_HOLDING_OFFSET + 5*EEPROM_PAGE_SIZE)) {
 		/* If writing outside of the holding area, commit page buffer immediately */
 		eeprom_emulator_commit_page_buffer();
 	}
+	eeprom_end();
+	if (status != STATUS_OK) {
+		return -1;
+	}
 	
 	return 0;
 }
 
+/* Write the cached page (holding area) to the Flash */
+void eeprom_commit(void)
+{
+	if (eeprom_valid) {
+		eeprom_begin();
+		eeprom_emulator_commit_page_buffer();
+		eeprom_end();
+	}
+}
+
 #endif /* BOOTLOADER */
\ No newline at end of file
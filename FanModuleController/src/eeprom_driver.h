@@ -61,5 +61,7 @@ byte 40 to 60 = reserved
 void eeprom_init(void);
 int eeprom_read(uint8_t *buf, int offset, int len);
 int eeprom_write(const uint8_t *buf, int offset, int len);
+void eeprom_commit(void);
+void eeprom_commit_from_isr(void);
 
 #endif /* EEPROM_H_ */
\ No newline at end of file
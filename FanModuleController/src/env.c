@@ -7,6 +7,8 @@
 
 #include <asf.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <string.h>
 
 #include "eeprom_driver.h"
 #include "config.h"
@@ -18,36 +20,58 @@
 
 #ifndef BOOTLOADER
 
-#define ENV_MAX_ENTRIES		128
+#define ENV_MAX_ENTRIES		128		/* Largest environment accepted from the EEPROM (older versions reserved 128 words) */
+#define ENV_VERSION			1		/* 0: 128 words written; 1: only the ENV_SIZE words */
 
-#define CFG_ENV_DESC(_name, _default) \
-	_name,
+/* Variable schema */
+#define CFG_ENV_DESC(_idx, _name, _type, _default, _min, _max, _apply) \
+	[_idx] = { _name, _type, _default, _min, _max, _apply },
 
-static const char *env_vars[] = { CFG_ENV_DESCRIPTORS };
+static const struct env_desc {
+	const char *name;
+	enum env_type type;
+	uint32_t def;
+	uint32_t min;
+	uint32_t max;
+	void (*apply)(enum env_idx idx, uint32_t val);
+} env_descs[] = { CFG_ENV_DESCRIPTORS };
 
-#define ENV_SIZE		(sizeof(env_vars)/sizeof(*env_vars))
+#define ENV_SIZE		ENV_COUNT
 
 #undef CFG_ENV_DESC
 
-#define CFG_ENV_DESC(_name, _default) \
-	_default,
+#define CFG_ENV_DESC(_idx, _name, _type, _default, _min, _max, _apply) \
+	[_idx] = _default,
 
+/* EEPROM layout: the header, then the size words (older versions: 128 words) */
 struct env_cache_s {
 	uint32_t magic;
 #define ENV_HDR_MAGIC	0x87654321
 	uint8_t size;
+	uint8_t version;
 	uint16_t crc;
-	uint32_t data[ENV_MAX_ENTRIES];
-} env_cache = { ENV_HDR_MAGIC, ENV_SIZE, 0, { CFG_ENV_DESCRIPTORS }};
+	uint32_t data[ENV_SIZE];
+} env_cache = { ENV_HDR_MAGIC, ENV_SIZE, ENV_VERSION, 0, { CFG_ENV_DESCRIPTORS }};
 
+#define ENV_HDR_SIZE	offsetof(struct env_cache_s, data)
+
+static struct env_cache_s env_saved;	/* Copy of the EEPROM contents */
+static uint8_t env_saved_valid;
 static uint8_t env_dirty;
 
+static int env_valid(enum env_idx idx, uint32_t val)
+{
+	return val >= env_descs[idx].min && val <= env_descs[idx].max;
+}
+
 static int env_read(void)
 {
 	struct env_cache_s eeprom_copy;
-	int ret = 0, i;
+	uint32_t chunk[16];
+	uint16_t crc = 0;
+	int ret = 0, i, n;
 	
-	if (eeprom_read((uint8_t *)&eeprom_copy, CFG_EEPROM_ENV_OFFSET, sizeof(eeprom_copy)) < 0) {
+	if (eeprom_read((uint8_t *)&eeprom_copy, CFG_EEPROM_ENV_OFFSET, ENV_HDR_SIZE) < 0) {
 		PRINTF("ERROR: env_read(): failed to read EEPROM\r\n");
 		return -1;
 	}
@@ -59,7 +83,18 @@ static int env_read(void)
 		PRINTF("ENV: invalid size\r\n");
 		return -1;
 	}
-	uint16_t crc = crc16(0, (const uint8_t *)eeprom_copy.data, eeprom_copy.size*sizeof(uint32_t), 0x1021);
+	/* Check the CRC over all the saved words, keep the known ones */
+	for (i = 0; i < eeprom_copy.size; i += n) {
+		n = min(eeprom_copy.size - i, (int)(sizeof(chunk)/sizeof(*chunk)));
+		if (eeprom_read((uint8_t *)chunk, CFG_EEPROM_ENV_OFFSET + ENV_HDR_SIZE + i*sizeof(uint32_t), n*sizeof(uint32_t)) < 0) {
+			PRINTF("ERROR: env_read(): failed to read EEPROM\r\n");
+			return -1;
+		}
+		crc = crc16(crc, (const uint8_t *)chunk, n*sizeof(uint32_t), 0x1021);
+		if (i < ENV_SIZE) {
+			memcpy(&eeprom_copy.data[i], chunk, min(n, ENV_SIZE - i)*sizeof(uint32_t));
+		}
+	}
 	if (crc != eeprom_copy.crc) {
 		PRINTF("ENV: bad CRC\r\n");
 		return -1;
@@ -71,27 +106,60 @@ static int env_read(void)
 	} else if (eeprom_copy.size > env_cache.size) {
 		PRINTF("WARNING: saved environment is longer than expected, ignoring extra values\r\n");
 		ret = 1;
+	} else if (eeprom_copy.version != ENV_VERSION) {
+		/* Same contents, rewritten in the current format */
+		ret = 1;
 	}
-	for (i = 0; i < eeprom_copy.size; i++) {
-		env_cache.data[i] = eeprom_copy.data[i];
+	for (i = 0; i < eeprom_copy.size && i < ENV_SIZE; i++) {
+		if (env_valid(i, eeprom_copy.data[i])) {
+			env_cache.data[i] = eeprom_copy.data[i];
+		} else {
+			PRINTF("WARNING: %s = %lu out of range, using the default\r\n", env_descs[i].name, eeprom_copy.data[i]);
+			env_cache.data[i] = env_descs[i].def;
+			ret = 1;
+		}
+	}
+	if (!ret) {
+		env_saved = env_cache;
+		env_saved_valid = 1;
 	}
 	
 	return ret;
 }
 
+/*
+ * Write the environment to the EEPROM: only the emulator pages whose
+ * contents differ from the saved copy are written (and committed), and
+ * nothing at all if the variables were set back to their saved values.
+ */
 static void env_save(void) {
+	int offset, len;
+	
 	env_cache.magic = ENV_HDR_MAGIC;
 	env_cache.size = ENV_SIZE;
+	env_cache.version = ENV_VERSION;
 	env_cache.crc = crc16(0, (const uint8_t *)env_cache.data, ENV_SIZE*sizeof(uint32_t), 0x1021);
-	if (eeprom_write((uint8_t *)&env_cache, CFG_EEPROM_ENV_OFFSET, sizeof(env_cache)) < 0) {
-		PRINTF("ERROR: env_save(): failed to write to EEPROM\r\n");
+	/* CFG_EEPROM_ENV_OFFSET is page aligned */
+	for (offset = 0; offset < (int)sizeof(env_cache); offset += EEPROM_PAGE_SIZE) {
+		len = min((int)sizeof(env_cache) - offset, EEPROM_PAGE_SIZE);
+		if (env_saved_valid && !memcmp((uint8_t *)&env_cache + offset, (uint8_t *)&env_saved + offset, len)) {
+			continue;
+		}
+		if (eeprom_write((uint8_t *)&env_cache + offset, CFG_EEPROM_ENV_OFFSET + offset, len) < 0) {
+			PRINTF("ERROR: env_save(): failed to write to EEPROM\r\n");
+			env_saved_valid = 0;
+			return;
+		}
 	}
+	env_saved = env_cache;
+	env_saved_valid = 1;
 }
 
 void env_reset(void) {
+	uint32_t magic = 0;
+	
 	PRINTF("ENV: resetting to default environment\r\n");
-	env_cache.magic = 0;
-	if (eeprom_write((uint8_t *)&env_cache, CFG_EEPROM_ENV_OFFSET, sizeof(env_cache)) < 0) {
+	if (eeprom_write((uint8_t *)&magic, CFG_EEPROM_ENV_OFFSET, sizeof(magic)) < 0) {
 		PRINTF("ERROR: env_save(): failed to write to EEPROM\r\n");
 	}
 	SYSTEM_RESET;
@@ -111,7 +179,7 @@ int env_find(const char *var)
 	int i;
 	
 	for (i = 0; i < (int)ENV_SIZE; i++) {
-		if (!strcmp(var, env_vars[i])) {
+		if (!strcmp(var, env_descs[i].name)) {
 			return i;
 		}
 	}
@@ -119,6 +187,29 @@ int env_find(const char *var)
 	return -1;
 }
 
+/* Set a variable: checked against its range, the apply hook is called if it changes */
+int env_set_idx(enum env_idx idx, uint32_t val)
+{
+	if (!env_valid(idx, val)) {
+		PRINTF("ENV: %s must be in %lu..%lu\r\n", env_descs[idx].name, env_descs[idx].min, env_descs[idx].max);
+		return -1;
+	}
+	if (env_cache.data[idx] != val) {
+		env_cache.data[idx] = val;
+		env_dirty = 1;
+		if (env_descs[idx].apply) {
+			env_descs[idx].apply(idx, val);
+		}
+	}
+	
+	return 0;
+}
+
+uint32_t env_get_idx(enum env_idx idx)
+{
+	return env_cache.data[idx];
+}
+
 int env_set(const char *var, uint32_t val)
 {
 	int idx = env_find(var);
@@ -126,10 +217,7 @@ int env_set(const char *var, uint32_t val)
 		PRINTF("ENV: variable %s not found\r\n", var);
 		return -1;
 	}
-	env_cache.data[idx] = val;
-	env_dirty = 1;
-	
-	return 0;
+	return env_set_idx(idx, val);
 }
 
 uint32_t env_get(const char *var)
@@ -140,7 +228,7 @@ uint32_t env_get(const char *var)
 		return 0;
 	}
 	
-	return env_cache.data[idx];
+	return env_get_idx(idx);
 }
 
 void env_print_all(void)
@@ -148,7 +236,11 @@ void env_print_all(void)
 	int i;
 	
 	for (i = 0; i < (int)ENV_SIZE; i++) {
-		PRINTF("%s = %lu\r\n", env_vars[i], env_cache.data[i]);
+		if (env_descs[i].type == ENV_TYPE_BOOL) {
+			PRINTF("%s = %lu (0/1)\r\n", env_descs[i].name, env_cache.data[i]);
+		} else {
+			PRINTF("%s = %lu (%lu..%lu)\r\n", env_descs[i].name, env_cache.data[i], env_descs[i].min, env_descs[i].max);
+		}
 	}
 }
 
@@ -9,11 +9,32 @@
 #ifndef ENV_H_
 #define ENV_H_
 
+#include "config.h"
+
+/* Variable types (display) */
+enum env_type {
+	ENV_TYPE_UINT,
+	ENV_TYPE_BOOL
+};
+
+/* Variable indices, generated from CFG_ENV_DESCRIPTORS */
+#define CFG_ENV_DESC(_idx, ...) \
+	_idx,
+
+enum env_idx {
+	CFG_ENV_DESCRIPTORS
+	ENV_COUNT
+};
+
+#undef CFG_ENV_DESC
+
 void env_init(void);
 void env_reset(void);
 int env_find(const char *var);
 int env_set(const char *var, uint32_t val);
 uint32_t env_get(const char *var);
+int env_set_idx(enum env_idx idx, uint32_t val);
+uint32_t env_get_idx(enum env_idx idx);
 void env_print_all(void);
 void do_env(void);
 
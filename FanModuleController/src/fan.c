@@ -6,6 +6,8 @@
  */ 
 
 #include <asf.h>
+#include <stddef.h>
+#include <string.h>
 
 #include "fan.h" 
 #include "config.h"
@@ -13,29 +15,120 @@
 #include "sys_timer.h"
 #include "modbus.h"
 #include "env.h"
+#include "pid.h"
+#include "watchdog.h"
+#include "fixp.h"
+#include "curve.h"
 
 #ifndef BOOTLOADER
 
+#if defined(CFG_FAN_PID_ENABLE) && !defined(CFG_TACHO_CAPTURE_ENABLE)
+#error "The closed-loop fan control needs the tacho period capture (CFG_TACHO_CAPTURE_ENABLE)"
+#endif
+
+/* Number of do_fan() calls in a period */
+#define FAN_TICKS(_ms)		((_ms) / CFG_FAN_TASK_PERIOD)
+
+/* Register of a fan: the original ones for fan 0, the per-fan blocks for the others */
+#define FAN_REG(_idx, _fan0_reg, _block_reg)	((_idx) ? (_block_reg) : (_fan0_reg))
+
+/* FAN_CHANNELS is an enum: checked with a negative array size instead of #if */
+typedef char fan_input_block_fits[INPUT_REG__FAN_N(FAN_CHANNELS - 1, FAN_INPUT_REGS - 1) <= INPUT_REG__FAN_BLOCK_END ? 1 : -1];
+typedef char fan_hold_block_fits[HOLD_REG__FAN_N(FAN_CHANNELS - 1, FAN_HOLD_REGS - 1) <= HOLD_REG__FAN_BLOCK_END ? 1 : -1];
+
+#ifdef CFG_TACHO_CAPTURE_ENABLE
+#define TACHO_PRESCALER		64			/* Must match the TC prescaler below */
+#endif
+
+/* Fan channel: configuration (CFG_FAN_CHANNELS) and state */
+struct fan {
+	Tc *pwm_module;
+	uint8_t pwm_channel;
+	uint32_t pwm_pin;
+	uint32_t pwm_mux;
+	Tc *tacho_module;
+	uint8_t tacho_evsys_user;
+	uint8_t extint;
+	uint32_t tacho_pin;
+	uint32_t tacho_mux;
+	uint8_t evsys_channel;
+	uint8_t hold_request;
+	uint8_t hold_rpm_request;
+	uint8_t hold_curve_select;
+	uint8_t input_pwm;
+	uint8_t input_speed;
+	uint8_t input_deviation;
+	
+	struct tc_module *pwm_tc;				/* Shared by the fans on the same TC */
+	struct tc_module pwm_tc_instance;
+	struct tc_module tacho_tc;
+#ifdef CFG_TACHO_CAPTURE_ENABLE
+	volatile uint32_t tacho_period_sum;		/* Sum of the captured tacho periods (TC ticks) */
+	volatile uint16_t tacho_periods;		/* Number of captured tacho periods */
+	volatile uint8_t tacho_stalled;			/* No tacho edge for a full counter period */
+	volatile uint8_t tacho_wrapped;			/* The next captured period is not valid */
+#endif
+	uint8_t current_pwm;
+	uint8_t pwm_to_fan;
+	uint32_t rpm;
+#ifdef CFG_FAN_PID_ENABLE
+	struct pid pid;
+	uint8_t pid_active;
+	uint32_t pid_last;						/* Jiffies of the last PID update */
+#endif
+};
+
+#define CFG_FAN_CHANNEL(_idx, _pwm_module, _pwm_channel, _pwm_pin, _pwm_mux, _tacho_module, _tacho_evsys_user, \
+		_extint, _tacho_pin, _tacho_mux, _evsys_channel) \
+	[_idx] = { \
+		.pwm_module = _pwm_module, \
+		.pwm_channel = _pwm_channel, \
+		.pwm_pin = _pwm_pin, \
+		.pwm_mux = _pwm_mux, \
+		.tacho_module = _tacho_module, \
+		.tacho_evsys_user = _tacho_evsys_user, \
+		.extint = _extint, \
+		.tacho_pin = _tacho_pin, \
+		.tacho_mux = _tacho_mux, \
+		.evsys_channel = _evsys_channel, \
+		.hold_request = FAN_REG(_idx, HOLD_REG__FAN_REQUEST, HOLD_REG__FAN_N(_idx, FAN_HOLD_REQUEST)), \
+		.hold_rpm_request = FAN_REG(_idx, HOLD_REG__FAN_RPM_REQUEST, HOLD_REG__FAN_N(_idx, FAN_HOLD_RPM_REQUEST)), \
+		.hold_curve_select = FAN_REG(_idx, HOLD_REG__FAN_CURVE_SELECT, HOLD_REG__FAN_N(_idx, FAN_HOLD_CURVE_SELECT)), \
+		.input_pwm = FAN_REG(_idx, INPUT_REG__FAN_CURRENT_PWM, INPUT_REG__FAN_N(_idx, FAN_INPUT_PWM)), \
+		.input_speed = FAN_REG(_idx, INPUT_REG__FAN_CURRENT_SPEED, INPUT_REG__FAN_N(_idx, FAN_INPUT_SPEED)), \
+		.input_deviation = FAN_REG(_idx, INPUT_REG__RPM_DEVIATION_1_0, INPUT_REG__FAN_N(_idx, FAN_INPUT_DEVIATION)), \
+		.pwm_to_fan = CFG_PWM_INITIAL_VALUE, \
+	},
+
+static struct fan fans[] = { CFG_FAN_CHANNELS };
+
+#undef CFG_FAN_CHANNEL
+
+/* Fan of a tacho TC instance (in the TC callbacks) */
+#define FAN_OF_TACHO(_module)	((struct fan *)((char *)(_module) - offsetof(struct fan, tacho_tc)))
+
+#ifdef CFG_TACHO_CAPTURE_ENABLE
+static uint32_t tacho_clock_hz;
+#else
 static uint32_t cnt_tacho_1;
-static uint32_t last_pwm_adjust;
-static uint32_t last_tacho_measure;
-static uint32_t last_sync;
-static uint8_t current_pwm=0;
-static uint32_t fantacho1 = 0;
+static uint16_t tacho_measure_ticks;
+#endif /* CFG_TACHO_CAPTURE_ENABLE */
+static uint16_t pwm_adjust_ticks;
+static uint16_t sync_ticks;
 static uint8_t pwm_frequency;
 static uint8_t new_pwm_frequency;
 
-static struct tc_module tc_instance_pwm;
-static struct tc_module tc_instance_tacho;
-
+static void set_pwm(struct fan *fan);
+static void fan_apply_pwm(struct fan *fan);
+#ifndef CFG_TACHO_CAPTURE_ENABLE
 static void delete_extint_callbacks(void);
-static void set_pwm(void);
 static void tc_callback_timer1(struct tc_module *const module_inst);
 static void enable_extint_callbacks(void);
 static void extint_detection_callback_int_0(void);
-static void get_fan_speed(void);
+#endif
+static int get_fan_speed(struct fan *fan);
 static void fan_tacho_init(void);
-static void fan_sync_to_modbus(void);
+static void fan_sync_to_modbus(struct fan *fan);
 static void fan_pwm_init(uint8_t pwm_frequency_init);
 
 
@@ -43,10 +136,8 @@ static void fan_pwm_init(uint8_t pwm_frequency_init);
  * Calculate PWM value for the fans
  * Set PWM for the fans
  */
-static void set_pwm(void)
+static void set_pwm(struct fan *fan)
 {
-	static volatile uint8_t pwm_to_fan = CFG_PWM_INITIAL_VALUE;
-	uint8_t pwm_to_fan_invert;
 	uint8_t pwm;
 	
 	if(modbus_watchdog()==1)
@@ -55,7 +146,7 @@ static void set_pwm(void)
 	}
 	else
 	{
-		pwm = modbus_get_holding_reg(HOLD_REG__FAN_REQUEST);
+		pwm = modbus_get_holding_reg(fan->hold_request);
 	}
 	
 	if (pwm < modbus_get_holding_reg(HOLD_REG__FAN_REUEST_MIN))
@@ -73,71 +164,226 @@ static void set_pwm(void)
 		pwm = 0;
 	}
 	
-	if(pwm_to_fan < pwm) 
+	if(fan->pwm_to_fan < pwm) 
 	{
-		pwm_to_fan++;
+		fan->pwm_to_fan++;
 	}
 		
-	if(pwm_to_fan > pwm) 
+	if(fan->pwm_to_fan > pwm) 
 	{
-		pwm_to_fan--;
+		fan->pwm_to_fan--;
 	}
 	
-	if(pwm_to_fan > 100)
+	fan_apply_pwm(fan);
+}
+
+/* Output pwm_to_fan */
+static void fan_apply_pwm(struct fan *fan)
+{
+	uint8_t pwm_to_fan_invert;
+	
+	if(fan->pwm_to_fan > 100)
 	{
-		pwm_to_fan = 100;
+		fan->pwm_to_fan = 100;
 	}
 	
-	current_pwm = pwm_to_fan;
-	pwm_to_fan_invert = abs(pwm_to_fan - 100); //invert PWM	
-	tc_set_compare_value(&tc_instance_pwm, TC_COMPARE_CAPTURE_CHANNEL_0, pwm_to_fan_invert);
+	fan->current_pwm = fan->pwm_to_fan;
+	pwm_to_fan_invert = abs(fan->pwm_to_fan - 100); //invert PWM	
+	tc_set_compare_value(fan->pwm_tc, fan->pwm_channel, pwm_to_fan_invert);
+}
+
+/* Expected speed of a fan at its current PWM (0 without a valid curve) */
+static uint16_t fan_curve_rpm(struct fan *fan)
+{
+	return curve_rpm(modbus_get_holding_reg(fan->hold_curve_select), CURVE_PWM_Q16(fan->current_pwm));
 }
 
 
 /*
- * Initialize the PWM
+ * Initialize the PWM: each TC is set up once, with the channels of all the
+ * fans it drives, which continue from their current PWM
  */
 void fan_pwm_init(uint8_t pwm_frequency_init)
 {	
 	struct tc_config config_tc_fan_pwm;
-	tc_get_config_defaults(&config_tc_fan_pwm);
-	config_tc_fan_pwm.counter_size = TC_COUNTER_SIZE_8BIT;
+	struct fan *fan, *other;
+	
+	for (fan = fans; fan < fans + FAN_CHANNELS; fan++) {
+		for (other = fans; other < fan && other->pwm_module != fan->pwm_module; other++);
+		if (other < fan) {
+			fan->pwm_tc = other->pwm_tc;
+			continue;
+		}
+		
+		tc_get_config_defaults(&config_tc_fan_pwm);
+		config_tc_fan_pwm.counter_size = TC_COUNTER_SIZE_8BIT;
+		
+		switch(pwm_frequency_init)
+		{   
+			case 0:	config_tc_fan_pwm.clock_prescaler = TC_CLOCK_PRESCALER_DIV256; 	break;	//300Hz
+			case 1:	config_tc_fan_pwm.clock_prescaler = TC_CLOCK_PRESCALER_DIV64; 	break;  //1250Hz
+			case 2:	config_tc_fan_pwm.clock_prescaler = TC_CLOCK_PRESCALER_DIV16; 	break;  //5000Hz
+			case 3:	config_tc_fan_pwm.clock_prescaler = TC_CLOCK_PRESCALER_DIV8; 	break;  //10000Hz
+			case 4:	config_tc_fan_pwm.clock_prescaler = TC_CLOCK_PRESCALER_DIV4; 	break;	//20000Hz
+			case 5:	config_tc_fan_pwm.clock_prescaler = TC_CLOCK_PRESCALER_DIV2; 	break;	//40000Hz
+			default:	config_tc_fan_pwm.clock_prescaler = TC_CLOCK_PRESCALER_DIV16;	break; //5000Hz
+		}
+		
+		config_tc_fan_pwm.clock_source = GCLK_GENERATOR_0;
+		config_tc_fan_pwm.wave_generation = TC_WAVE_GENERATION_NORMAL_PWM;
+		config_tc_fan_pwm.counter_8_bit.value = 0;
+		config_tc_fan_pwm.counter_8_bit.period = 100;
+		for (other = fan; other < fans + FAN_CHANNELS; other++) {
+			if (other->pwm_module == fan->pwm_module) {
+				config_tc_fan_pwm.counter_8_bit.compare_capture_channel[other->pwm_channel] = 100 - other->pwm_to_fan;
+				config_tc_fan_pwm.pwm_channel[other->pwm_channel].enabled = true;
+				config_tc_fan_pwm.pwm_channel[other->pwm_channel].pin_out = other->pwm_pin;
+				config_tc_fan_pwm.pwm_channel[other->pwm_channel].pin_mux = other->pwm_mux;
+			}
+		}
+		tc_init(&fan->pwm_tc_instance, fan->pwm_module, &config_tc_fan_pwm);
+		tc_enable(&fan->pwm_tc_instance);
+		fan->pwm_tc = &fan->pwm_tc_instance;
+	}
+}
+
+
+#ifdef CFG_TACHO_CAPTURE_ENABLE
+
+/*
+ * Tacho input capture: the tacho pin of each fan drives an EXTINT line,
+ * whose event is routed through the EVSYS to the fan's TC, capturing the
+ * period between two rising edges (PPW: period in CC0, pulse width in CC1)
+ * without any CPU involvement. The capture interrupt only accumulates the
+ * periods; the RPM is computed from their average by do_fan(). The CPU
+ * cost per fan is one short interrupt per tacho edge and one division per
+ * task period, whatever the number of fans.
+ */
+static void tacho_capture_callback(struct tc_module *const module_inst)
+{
+	struct fan *fan = FAN_OF_TACHO(module_inst);
+	uint16_t period = tc_get_capture_value(module_inst, TC_COMPARE_CAPTURE_CHANNEL_0);
+	
+	if (fan->tacho_wrapped) {
+		/* The counter overflowed since the previous edge */
+		fan->tacho_wrapped = 0;
+		return;
+	}
+	fan->tacho_period_sum += period;
+	fan->tacho_periods++;
+}
+
+static void tacho_overflow_callback(struct tc_module *const module_inst)
+{
+	struct fan *fan = FAN_OF_TACHO(module_inst);
+	
+	fan->tacho_wrapped = 1;
+	fan->tacho_stalled = 1;
+}
+
+/* Route the EXTINT events of a fan to its tacho TC (no EVSYS driver in this project: register level) */
+static void fan_tacho_evsys_init(struct fan *fan)
+{
+	system_apb_clock_set_mask(SYSTEM_CLOCK_APB_APBC, PM_APBCMASK_EVSYS);
+	/* The user multiplexer takes the channel number + 1 (0: no channel) */
+	EVSYS->USER.reg = EVSYS_USER_USER(fan->tacho_evsys_user) | EVSYS_USER_CHANNEL(fan->evsys_channel + 1);
+	/* Asynchronous path: the event follows the pin level, as required by the PPW capture */
+	EVSYS->CHANNEL.reg = EVSYS_CHANNEL_CHANNEL(fan->evsys_channel) | EVSYS_CHANNEL_EVGEN(EVSYS_ID_GEN_EIC_EXTINT_0 + fan->extint)
+		| EVSYS_CHANNEL_PATH_ASYNCHRONOUS;
+}
+
+static void fan_tacho_init(void)
+{
+	struct tc_config config_tc_tacho;
+	struct tc_events events_tc_tacho = { .on_event_perform_action = true, .event_action = TC_EVENT_ACTION_PPW };
+	struct extint_chan_conf config_extint;
+	struct extint_events events_extint;
+	struct fan *fan;
+	
+	tacho_clock_hz = system_gclk_gen_get_hz(GCLK_GENERATOR_0) / TACHO_PRESCALER;
+	for (fan = fans; fan < fans + FAN_CHANNELS; fan++) {
+		tc_get_config_defaults(&config_tc_tacho);
+		config_tc_tacho.counter_size = TC_COUNTER_SIZE_16BIT;
+		config_tc_tacho.clock_source = GCLK_GENERATOR_0;
+		config_tc_tacho.clock_prescaler = TC_CLOCK_PRESCALER_DIV64; //8000000Hz/64 = 125kHz ==> 8us resolution, overflow after 524ms
+		config_tc_tacho.enable_capture_on_channel[TC_COMPARE_CAPTURE_CHANNEL_0] = true;
+		config_tc_tacho.enable_capture_on_channel[TC_COMPARE_CAPTURE_CHANNEL_1] = true;
+		tc_init(&fan->tacho_tc, fan->tacho_module, &config_tc_tacho);
+		tc_enable_events(&fan->tacho_tc, &events_tc_tacho);
+		tc_register_callback(&fan->tacho_tc, tacho_capture_callback, TC_CALLBACK_CC_CHANNEL0);
+		tc_register_callback(&fan->tacho_tc, tacho_overflow_callback, TC_CALLBACK_OVERFLOW);
+		tc_enable_callback(&fan->tacho_tc, TC_CALLBACK_CC_CHANNEL0);
+		tc_enable_callback(&fan->tacho_tc, TC_CALLBACK_OVERFLOW);
+		fan->tacho_wrapped = 1;
+		
+		/* Level detection: the event mirrors the (filtered) tacho signal */
+		extint_chan_get_config_defaults(&config_extint);
+		config_extint.gpio_pin           = fan->tacho_pin;
+		config_extint.gpio_pin_mux       = fan->tacho_mux;
+		config_extint.gpio_pin_pull      = EXTINT_PULL_UP;
+		config_extint.detection_criteria = EXTINT_DETECT_HIGH;
+		config_extint.filter_input_signal = true;
+		extint_chan_set_config(fan->extint, &config_extint);
+		memset(&events_extint, 0, sizeof(events_extint));
+		events_extint.generate_event_on_detect[fan->extint] = true;
+		extint_enable_events(&events_extint);
+		
+		fan_tacho_evsys_init(fan);
+		tc_enable(&fan->tacho_tc);
+	}
+}
+
+/* Compute the speed of a fan from the periods captured since the last call: 1 if updated, 0 if not */
+static int get_fan_speed(struct fan *fan)
+{
+	uint32_t sum;
+	uint16_t periods;
+	uint8_t stalled, pulses_per_rotation;
+	
+	system_interrupt_enter_critical_section();
+	sum = fan->tacho_period_sum;
+	periods = fan->tacho_periods;
+	stalled = fan->tacho_stalled;
+	fan->tacho_period_sum = 0;
+	fan->tacho_periods = 0;
+	fan->tacho_stalled = 0;
+	system_interrupt_leave_critical_section();
 	
-	switch(pwm_frequency_init)
-	{   
-		case 0:	config_tc_fan_pwm.clock_prescaler = TC_CLOCK_PRESCALER_DIV256; 	break;	//300Hz
-		case 1:	config_tc_fan_pwm.clock_prescaler = TC_CLOCK_PRESCALER_DIV64; 	break;  //1250Hz
-		case 2:	config_tc_fan_pwm.clock_prescaler = TC_CLOCK_PRESCALER_DIV16; 	break;  //5000Hz
-		case 3:	config_tc_fan_pwm.clock_prescaler = TC_CLOCK_PRESCALER_DIV8; 	break;  //10000Hz
-		case 4:	config_tc_fan_pwm.clock_prescaler = TC_CLOCK_PRESCALER_DIV4; 	break;	//20000Hz
-		case 5:	config_tc_fan_pwm.clock_prescaler = TC_CLOCK_PRESCALER_DIV2; 	break;	//40000Hz
-		default:	config_tc_fan_pwm.clock_prescaler = TC_CLOCK_PRESCALER_DIV16;	break; //5000Hz
+	pulses_per_rotation = modbus_get_holding_reg(HOLD_REG__PULSES_PER_REVOLUTION);
+	if (periods && sum && pulses_per_rotation) {
+		/* rpm = 60 s / (average period * pulses per revolution) */
+		fan->rpm = (uint32_t)((60ULL * tacho_clock_hz * periods) / ((uint64_t)sum * pulses_per_rotation));
+	} else if (stalled) {
+		fan->rpm = 0;
+	} else {
+		/* No complete period yet (slow fan): keep the last value */
+		return 0;
 	}
 	
-	config_tc_fan_pwm.clock_source = GCLK_GENERATOR_0;
-	config_tc_fan_pwm.wave_generation = TC_WAVE_GENERATION_NORMAL_PWM;
-	config_tc_fan_pwm.counter_8_bit.value = 0;
-	config_tc_fan_pwm.counter_8_bit.compare_capture_channel[0] = 100-CFG_PWM_INITIAL_VALUE;
-	config_tc_fan_pwm.counter_8_bit.period = 100;
-	config_tc_fan_pwm.pwm_channel[0].enabled = true;
-	config_tc_fan_pwm.pwm_channel[0].pin_out = CFG_PWM1_PIN;
-	config_tc_fan_pwm.pwm_channel[0].pin_mux = CFG_PWM1_MUX;
-	tc_init(&tc_instance_pwm, CFG_PWM_MODULE, &config_tc_fan_pwm);
-	tc_enable(&tc_instance_pwm);
+	modbus_set_input_reg(fan->input_speed, fan->rpm);
+	modbus_set_input_reg(fan->input_deviation, fixp_percent(fan->rpm, fan_curve_rpm(fan)));
+	
+	return 1;
 }
 
+#else
+
+/*
+ * Gated edge count: fan 0 only (the other fans need the period capture)
+ */
 
 /*
  * Initialize Tacho Pulse counter
  */
 static void tc_callback_timer1(struct tc_module *const module_inst)
 {
+	struct fan *fan = FAN_OF_TACHO(module_inst);
 	uint8_t pulses_per_rotation;
-	tc_stop_counter(&tc_instance_tacho);
+	tc_stop_counter(&fan->tacho_tc);
 	delete_extint_callbacks();
 	pulses_per_rotation = modbus_get_holding_reg(HOLD_REG__PULSES_PER_REVOLUTION);
-	fantacho1 = cnt_tacho_1 * (60/pulses_per_rotation);
-	modbus_set_input_reg(INPUT_REG__RPM_DEVIATION_1_0, (uint16_t)(100 * (float)fantacho1 / (float)(modbus_get_holding_reg(HOLD_REG__FAN_CURVE_PWM_0+current_pwm))));
+	fan->rpm = cnt_tacho_1 * (60/pulses_per_rotation);
+	modbus_set_input_reg(fan->input_deviation, fixp_percent(fan->rpm, fan_curve_rpm(fan)));
 }
 
 /*---configure_extint_callbacks---
@@ -145,13 +391,13 @@ static void tc_callback_timer1(struct tc_module *const module_inst)
 */
 static void delete_extint_callbacks(void)
 {
-	extint_unregister_callback(extint_detection_callback_int_0 ,0,EXTINT_CALLBACK_TYPE_DETECT);
+	extint_unregister_callback(extint_detection_callback_int_0, fans[0].extint, EXTINT_CALLBACK_TYPE_DETECT);
 }
 
 static void enable_extint_callbacks(void)
 {
-	extint_chan_enable_callback(0 ,EXTINT_CALLBACK_TYPE_DETECT);
-	extint_register_callback(extint_detection_callback_int_0, 0 ,EXTINT_CALLBACK_TYPE_DETECT);
+	extint_chan_enable_callback(fans[0].extint, EXTINT_CALLBACK_TYPE_DETECT);
+	extint_register_callback(extint_detection_callback_int_0, fans[0].extint, EXTINT_CALLBACK_TYPE_DETECT);
 }
 
 static void extint_detection_callback_int_0(void)
@@ -163,6 +409,7 @@ static void extint_detection_callback_int_0(void)
 /* Initialize 1sec timer for fan measurement. */
 static void fan_tacho_init(void)
 {
+	struct fan *fan = &fans[0];
 	struct tc_config config_tc_tacho;
 	tc_get_config_defaults(&config_tc_tacho);
 	config_tc_tacho.counter_size = TC_COUNTER_SIZE_16BIT;
@@ -170,34 +417,88 @@ static void fan_tacho_init(void)
 	config_tc_tacho.clock_prescaler = TC_CLOCK_PRESCALER_DIV256;
 	config_tc_tacho.counter_16_bit.value = 0;
 	config_tc_tacho.counter_16_bit.compare_capture_channel[TC_COMPARE_CAPTURE_CHANNEL_0] = 31250; //1 sec timer ==> 8000000Hz/256/31250 = 1Hz
-	tc_init(&tc_instance_tacho, CFG_TACHO_MODULE, &config_tc_tacho);
-	tc_enable(&tc_instance_tacho);
-	tc_register_callback(&tc_instance_tacho, tc_callback_timer1, TC_CALLBACK_CC_CHANNEL0);
-	tc_enable_callback(&tc_instance_tacho, TC_CALLBACK_CC_CHANNEL0);
-	tc_stop_counter(&tc_instance_tacho);
+	tc_init(&fan->tacho_tc, fan->tacho_module, &config_tc_tacho);
+	tc_enable(&fan->tacho_tc);
+	tc_register_callback(&fan->tacho_tc, tc_callback_timer1, TC_CALLBACK_CC_CHANNEL0);
+	tc_enable_callback(&fan->tacho_tc, TC_CALLBACK_CC_CHANNEL0);
+	tc_stop_counter(&fan->tacho_tc);
 	
 	struct extint_chan_conf config_extint_0;
 	extint_chan_get_config_defaults(&config_extint_0);
-	config_extint_0.gpio_pin           = CFG_INT0_PIN_FAN1;
-	config_extint_0.gpio_pin_mux       = CFG_INT0_MUX_FAN1;
+	config_extint_0.gpio_pin           = fan->tacho_pin;
+	config_extint_0.gpio_pin_mux       = fan->tacho_mux;
 	config_extint_0.gpio_pin_pull      = EXTINT_PULL_UP;
 	config_extint_0.detection_criteria = EXTINT_DETECT_RISING;
-	extint_chan_set_config(0, &config_extint_0);
+	extint_chan_set_config(fan->extint, &config_extint_0);
+	if (FAN_CHANNELS > 1) {
+		PRINTF("FAN: no tacho measurement of fans 1..%d without the period capture\r\n", FAN_CHANNELS - 1);
+	}
 }
 
-static void get_fan_speed(void)
+/* Start a gated count: the speed is updated later by tc_callback_timer1() */
+static int get_fan_speed(struct fan *fan)
 {
 	cnt_tacho_1 = 0;
-	tc_stop_counter(&tc_instance_tacho);
-	tc_start_counter(&tc_instance_tacho);
+	tc_stop_counter(&fan->tacho_tc);
+	tc_start_counter(&fan->tacho_tc);
 	enable_extint_callbacks();
+	
+	return 0;
+}
+
+#endif /* CFG_TACHO_CAPTURE_ENABLE */
+
+#ifdef CFG_FAN_PID_ENABLE
+
+/*
+ * Closed-loop mode: the fan curve gives the feed-forward PWM for the
+ * requested RPM, and the PID corrects for the difference between the curve
+ * and the actual fan (tolerances, ageing). Runs on every new speed sample,
+ * over the time actually elapsed since the previous one: a slow fan may
+ * not complete a tacho period in every task period.
+ */
+static void fan_closed_loop(struct fan *fan, int new_sample)
+{
+	uint32_t now = get_jiffies(), dt;
+	uint16_t rpm_request;
+	int32_t ff, out;
+	
+	if (modbus_get_holding_reg(HOLD_REG__FAN_CONTROL_MODE) != FAN_CONTROL_MODE_RPM
+			|| modbus_watchdog() == 1 || modbus_get_holding_reg(HOLD_REG__UNIT_OFF_ON) == 0) {
+		/* Open loop: set_pwm() ramps on from the current PWM */
+		fan->pid_active = 0;
+		return;
+	}
+	if (fan->pid_active && !new_sample) {
+		/* Same speed as last time: don't integrate its error again */
+		return;
+	}
+	
+	rpm_request = modbus_get_holding_reg(fan->hold_rpm_request);
+	ff = curve_pwm(modbus_get_holding_reg(fan->hold_curve_select), rpm_request);
+	fan->pid.out_min = PID_Q16(modbus_get_holding_reg(HOLD_REG__FAN_REUEST_MIN));
+	fan->pid.out_max = PID_Q16(modbus_get_holding_reg(HOLD_REG__FAN_REUEST_MAX));
+	pid_set_gains(&fan->pid, modbus_get_holding_reg(HOLD_REG__FAN_PID_KP), modbus_get_holding_reg(HOLD_REG__FAN_PID_KI),
+		modbus_get_holding_reg(HOLD_REG__FAN_PID_KD));
+	if (!fan->pid_active) {
+		/* Bumpless transfer: continue from the current PWM */
+		pid_reset(&fan->pid, rpm_request, fan->rpm, ff, PID_Q16(fan->current_pwm));
+		fan->pid_active = 1;
+		fan->pid_last = now - CFG_FAN_TASK_PERIOD;
+	}
+	dt = now - fan->pid_last;
+	fan->pid_last = now;
+	out = pid_update(&fan->pid, rpm_request, fan->rpm, ff, dt > 0xFFFF ? 0xFFFF : dt);
+	fan->pwm_to_fan = (out + PID_Q16(0.5)) >> 16;
+	fan_apply_pwm(fan);
 }
 
+#endif /* CFG_FAN_PID_ENABLE */
 
-static void fan_sync_to_modbus(void)
+static void fan_sync_to_modbus(struct fan *fan)
 {	
-	modbus_set_input_reg(INPUT_REG__FAN_CURRENT_PWM, current_pwm);
-	modbus_set_input_reg(INPUT_REG__FAN_CURRENT_SPEED, fantacho1);
+	modbus_set_input_reg(fan->input_pwm, fan->current_pwm);
+	modbus_set_input_reg(fan->input_speed, fan->rpm);
 }
 
 void fan_init(void)
@@ -209,16 +510,27 @@ void fan_init(void)
 	
 	fan_pwm_init(pwm_frequency);
 	fan_tacho_init();
-	
+	curve_init();
+	PRINTF("FAN: %d channel(s)\r\n", FAN_CHANNELS);
 }
 
 void do_fan(void)
 {	
-	if (get_jiffies() - last_pwm_adjust >= (100 * (1+ modbus_get_holding_reg(HOLD_REG__PWM_DELAY))))
+	struct fan *fan;
+	
+	/* Called every CFG_FAN_TASK_PERIOD ms by the scheduler */
+	curve_update();
+	if (++pwm_adjust_ticks >= FAN_TICKS(100 * (1+ modbus_get_holding_reg(HOLD_REG__PWM_DELAY))))
 	{
-		last_pwm_adjust = get_jiffies();
+		pwm_adjust_ticks = 0;
 		
-		set_pwm();
+		for (fan = fans; fan < fans + FAN_CHANNELS; fan++) {
+#ifdef CFG_FAN_PID_ENABLE
+			/* In closed-loop mode, the PWM is set by fan_closed_loop() */
+			if (!fan->pid_active)
+#endif
+			set_pwm(fan);
+		}
 		
 		if(modbus_get_holding_reg(HOLD_REG__UNIT_OFF_ON) == 0)
 		{
@@ -230,14 +542,26 @@ void do_fan(void)
 		}	
 	}
 	
-	if (get_jiffies() - last_tacho_measure >= 2000) {
-		last_tacho_measure = get_jiffies();
-		get_fan_speed();
+#ifdef CFG_TACHO_CAPTURE_ENABLE
+	for (fan = fans; fan < fans + FAN_CHANNELS; fan++) {
+#ifdef CFG_FAN_PID_ENABLE
+		fan_closed_loop(fan, get_fan_speed(fan));
+#else
+		get_fan_speed(fan);
+#endif
 	}
+#else
+	if (++tacho_measure_ticks >= FAN_TICKS(2000)) {
+		tacho_measure_ticks = 0;
+		get_fan_speed(&fans[0]);
+	}
+#endif
 	
-	if (get_jiffies() - last_sync >= 1000) {
-		last_sync = get_jiffies();
-		fan_sync_to_modbus();
+	if (++sync_ticks >= FAN_TICKS(1000)) {
+		sync_ticks = 0;
+		for (fan = fans; fan < fans + FAN_CHANNELS; fan++) {
+			fan_sync_to_modbus(fan);
+		}
 	}
 	
 
@@ -245,9 +569,25 @@ void do_fan(void)
 	if (new_pwm_frequency != pwm_frequency) {
 		PRINTF("PWM: changing pwm frequency to %d\r\n", (int)new_pwm_frequency);
 		pwm_frequency = new_pwm_frequency;
-		tc_reset(&tc_instance_pwm);
+		for (fan = fans; fan < fans + FAN_CHANNELS; fan++) {
+			if (fan->pwm_tc == &fan->pwm_tc_instance) {
+				tc_reset(fan->pwm_tc);
+			}
+		}
 		fan_pwm_init(pwm_frequency);
 	}
 }
 
+/* Current PWM (%) and speed (RPM) of a fan; -1 if there is no such fan */
+int fan_get_status(int idx, uint8_t *pwm, uint32_t *rpm)
+{
+	if (idx < 0 || idx >= FAN_CHANNELS) {
+		return -1;
+	}
+	*pwm = fans[idx].current_pwm;
+	*rpm = fans[idx].rpm;
+	
+	return 0;
+}
+
 #endif /* BOOTLOADER */
\ No newline at end of file
@@ -9,7 +9,18 @@
 #ifndef FAN_H_
 #define FAN_H_
 
+#include "config.h"
+
+/* Fan indexes (CFG_FAN_CHANNELS) */
+#define CFG_FAN_CHANNEL(_idx, ...)	FAN_##_idx,
+enum fan_idx {
+	CFG_FAN_CHANNELS
+	FAN_CHANNELS
+};
+#undef CFG_FAN_CHANNEL
+
 void fan_init(void);
 void do_fan(void);
+int fan_get_status(int idx, uint8_t *pwm, uint32_t *rpm);
 
 #endif /* FAN_H_ */
\ No newline at end of file
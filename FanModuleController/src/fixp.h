@@ -0,0 +1,37 @@
+/*
+ * fixp.h: scaled-integer conversions (no floating point)
+ *
+ * Created: 10/16/2026 4:05:31 PM
+ *  Author: E1210640
+ */ 
+
+#ifndef __FIXP_H__
+#define __FIXP_H__
+
+/*
+ * Calibration constants are rationals: value = raw * num / den + offset.
+ * The result is truncated towards zero, like the (int)float conversions
+ * it replaces; raw * num and offset * den must fit in 31 bits.
+ * Error bound against those float conversions (test/test_fixp.c, all raw
+ * codes): INA226 current and voltage are bit-exact; SHT31 temperature
+ * (15 codes) and humidity (17 codes) differ by 1 LSB (0.01 degC / 0.01 %RH),
+ * where single-precision float rounded above the exact rational value.
+ */
+static inline int32_t fixp_convert(uint16_t raw, int32_t num, int32_t den, int32_t offset)
+{
+	return ((int32_t)raw * num + offset * den) / den;
+}
+
+/* Unsigned variant without offset: raw * num must fit in 32 bits */
+static inline uint32_t fixp_scale(uint16_t raw, uint32_t num, uint32_t den)
+{
+	return (uint32_t)raw * num / den;
+}
+
+/* Ratio num / den in percent (0 if den is 0) */
+static inline uint16_t fixp_percent(uint32_t num, uint32_t den)
+{
+	return den ? (uint16_t)(100 * num / den) : 0;
+}
+
+#endif /* __FIXP_H__ */
\ No newline at end of file
@@ -13,7 +13,7 @@
 #include "modbus.h"
 #include "env.h"
 
-/* Heartbeat: toggle the LED */
+/* Heartbeat: toggle the LED every skip calls */
 void do_heartbeat(uint32_t skip)
 {
 	static volatile uint32_t cnt;
@@ -13,93 +13,191 @@
 #include "cli.h"
 #include "sys_timer.h"
 #include "modbus.h"
+#include "sched.h"
+#include "ina226.h"
+#include "sht31.h"
 
 #ifndef BOOTLOADER
 
-static struct i2c_master_packet wr_packet;
-static struct i2c_master_packet rd_packet;
-static struct i2c_master_module i2c_master_instance;
-static volatile bool i2c_master_write_complete = false;
-static volatile bool i2c_master_read_complete = false;
-static volatile uint32_t cnt_i2c_master_timeout;
-static uint32_t ina226_1sec_timer = 0;
-static uint32_t ina226_current = 0,  ina226_voltage=0;
-static uint16_t	t_h_temperature, t_h_humidity;
+/* Sensor states */
+enum i2c_sensor_state {
+	I2C_SENSOR_IDLE,		/* Waiting for the next sample */
+	I2C_SENSOR_BUSY,		/* Sample transactions queued */
+	I2C_SENSOR_RECOVER		/* Running the driver's recovery steps */
+};
+
+#define CFG_I2C_SENSOR(_idx, _name, _driver, _address, _period, _input_reg, _aux_input_reg, _discrete_input) \
+	[_idx] = { \
+		.driver = &_driver, \
+		.name = _name, \
+		.address = _address, \
+		.period = _period, \
+		.input_reg = _input_reg, \
+		.aux_input_reg = _aux_input_reg, \
+		.discrete_input = _discrete_input, \
+	},
+
+static struct i2c_sensor i2c_sensors[] = { CFG_I2C_SENSORS };
+
+#undef CFG_I2C_SENSOR
 
+static struct i2c_master_packet packet;
+static struct i2c_master_module i2c_master_instance;
+static struct i2c_xfer *volatile i2c_queue_head;	/* Transaction in progress */
+static struct i2c_xfer *i2c_queue_tail;
+static volatile uint32_t i2c_xfer_start;			/* Jiffies when the transaction in progress started */
+static volatile uint32_t i2c_xfer_start_us;
+static volatile uint32_t i2c_busy_us;				/* Bus busy time in the current second */
+static struct i2c_stats i2c_stats;
+static uint32_t i2c_last_rate;
 
 /* Forward declarations */
 static void i2c_master_write_complete_callback(struct i2c_master_module *const module);
 static void i2c_master_read_complete_callback(struct i2c_master_module *const module);
 static void i2c_master_error_callback(struct i2c_master_module *const module);
-static int i2c_master_write (uint8_t *write_buffer, uint16_t data_length, uint16_t slave_address);
-static int i2c_master_read (uint8_t *read_buffer, uint16_t data_length, uint16_t slave_address);
-static void i2c_local_sync_to_modbus(void);
-static uint8_t send_buffer[10], read_buffer[10];
+static void i2c_xfer_start_job(struct i2c_xfer *xfer);
+static void i2c_xfer_complete(enum i2c_xfer_status status);
+
+/*
+ * Transaction engine: transactions are queued by i2c_submit() and run one
+ * after the other from the SERCOM callbacks. Completion wakes the I2C task.
+ */
 
-static void i2c_get_values(void)
+/* Start a transaction (called with the queue locked or from a callback) */
+static void i2c_xfer_start_job(struct i2c_xfer *xfer)
 {
-	send_buffer[0] = 1;
-	i2c_master_write(send_buffer, 1, CFG_I2C_ADDRESS_INA226);
-	if(i2c_master_read(read_buffer, 2, CFG_I2C_ADDRESS_INA226) == 0)
-	{
-		ina226_current = (uint32_t)(1000 * ((float)((read_buffer[0]<<8) | read_buffer[1])) * 0.0000025 / 0.001);
-		modbus_set_discrete_input(DIS_INPUT__CURRENT_SENSOR_BROKEN, 0);
+	enum status_code status;
+	
+	i2c_xfer_start = get_jiffies();
+	i2c_xfer_start_us = get_micros();
+	packet.address = xfer->address;
+	if (xfer->wr_len) {
+		packet.data = xfer->wr_buf;
+		packet.data_length = xfer->wr_len;
+		status = i2c_master_write_packet_job(&i2c_master_instance, &packet);
+	} else {
+		packet.data = xfer->rd_buf;
+		packet.data_length = xfer->rd_len;
+		status = i2c_master_read_packet_job(&i2c_master_instance, &packet);
 	}
-	else
-	{
-		ina226_current = 0;
-		modbus_set_discrete_input(DIS_INPUT__CURRENT_SENSOR_BROKEN, 1);
+	if (status != STATUS_OK) {
+		i2c_xfer_complete(I2C_XFER_ERROR);
 	}
+}
+
+/* Finish the transaction in progress and start the next one */
+static void i2c_xfer_complete(enum i2c_xfer_status status)
+{
+	struct i2c_xfer *xfer = i2c_queue_head;
 	
-	send_buffer[0] = 2;
-	i2c_master_write(send_buffer, 1, CFG_I2C_ADDRESS_INA226);
-	if(i2c_master_read(read_buffer, 2, CFG_I2C_ADDRESS_INA226) == 0)
-	{
-		ina226_voltage = (uint32_t)(1000* ((float)((read_buffer[0]<<8) | read_buffer[1]))  * 0.00125 / 0.2130); //theoretically 0.21541318, but there is a offset.
-		modbus_set_discrete_input(DIS_INPUT__VOLTAGE_SENSOR_BROKEN, 0);
+	if (!xfer) {
+		return;
+	}
+	i2c_busy_us += get_micros() - i2c_xfer_start_us;
+	i2c_stats.xfers++;
+	if (status == I2C_XFER_ERROR) {
+		i2c_stats.errors++;
+	} else if (status == I2C_XFER_TIMEOUT) {
+		i2c_stats.timeouts++;
 	}
-	else
-	{
-		ina226_voltage = 0;
-		modbus_set_discrete_input(DIS_INPUT__VOLTAGE_SENSOR_BROKEN, 1);
+	i2c_queue_head = xfer->next;
+	xfer->status = status;
+	sched_wake(SCHED_I2C_LOCAL);
+	if (i2c_queue_head) {
+		i2c_xfer_start_job(i2c_queue_head);
+	}
+}
+
+/* Queue a transaction: write wr_len bytes (if any), then read rd_len bytes (if any) */
+void i2c_submit(struct i2c_xfer *xfer)
+{
+	xfer->status = I2C_XFER_PENDING;
+	xfer->next = NULL;
+	system_interrupt_enter_critical_section();
+	if (i2c_queue_head) {
+		i2c_queue_tail->next = xfer;
+		i2c_queue_tail = xfer;
+	} else {
+		i2c_queue_head = i2c_queue_tail = xfer;
+		i2c_xfer_start_job(xfer);
 	}
-		
-	if(i2c_master_read(read_buffer, 6, CFG_I2C_ADDRESS_T_H) == 0)
-	{
-		t_h_temperature = (uint16_t)(100*(-45+175*((float)((read_buffer[0]<<8) | read_buffer[1]))/(65536-1)));
-		t_h_humidity = (uint16_t)(100*100*((float)((read_buffer[3]<<8) | read_buffer[4]))/(65536-1));
-		modbus_set_discrete_input(DIS_INPUT__TEMP_SENSOR_BROKEN, 0);
-		modbus_set_discrete_input(DIS_INPUT__HUMIDITY_SENSOR_BROKEN, 0);
+	system_interrupt_leave_critical_section();
+}
+
+/* Queue a transaction of a sensor sample (the sample is complete when the last one is) */
+void i2c_sensor_submit(struct i2c_sensor *sensor, struct i2c_xfer *xfer)
+{
+	xfer->address = sensor->address;
+	sensor->last = xfer;
+	i2c_submit(xfer);
+}
+
+/* Abort the transaction in progress if it takes longer than CFG_I2C_MASTER_TIMEOUT ms */
+static void i2c_check_timeout(void)
+{
+	system_interrupt_enter_critical_section();
+	if (i2c_queue_head && time_after(get_jiffies(), i2c_xfer_start + CFG_I2C_MASTER_TIMEOUT)) {
+		i2c_master_cancel_job(&i2c_master_instance);
+		i2c_xfer_complete(I2C_XFER_TIMEOUT);
 	}
-	else
-	{
-		t_h_temperature = 0;
-		t_h_humidity = 0;
-		modbus_set_discrete_input(DIS_INPUT__TEMP_SENSOR_BROKEN, 1);
-		modbus_set_discrete_input(DIS_INPUT__HUMIDITY_SENSOR_BROKEN, 1);
-		ioport_set_pin_level(CFG_RESET_SHT31, IOPORT_PIN_LEVEL_HIGH);
-		delay_cycles_ms(1);
-		ioport_set_pin_level(CFG_RESET_SHT31, IOPORT_PIN_LEVEL_LOW);
-		delay_cycles_ms(5);
+	system_interrupt_leave_critical_section();
+}
+
+/* Queue a transaction and wait for it (diagnostics only: blocks the main loop) */
+enum i2c_xfer_status i2c_transfer(struct i2c_xfer *xfer)
+{
+	i2c_submit(xfer);
+	while (xfer->status == I2C_XFER_PENDING) {
+		i2c_check_timeout();
 	}
-	send_buffer[0] = 0x24;
-	send_buffer[1] = 0x0B;
-	i2c_master_write(send_buffer, 2, CFG_I2C_ADDRESS_T_H);	
+	
+	return xfer->status;
 }
 
 static void i2c_master_write_complete_callback(struct i2c_master_module *const module)
 {
-	i2c_master_write_complete = true;
+	struct i2c_xfer *xfer = i2c_queue_head;
+	
+	if (xfer && xfer->rd_len) {
+		/* Write phase done: read */
+		packet.data = xfer->rd_buf;
+		packet.data_length = xfer->rd_len;
+		if (i2c_master_read_packet_job(&i2c_master_instance, &packet) != STATUS_OK) {
+			i2c_xfer_complete(I2C_XFER_ERROR);
+		}
+	} else {
+		i2c_xfer_complete(I2C_XFER_DONE);
+	}
 }
 
 static void i2c_master_read_complete_callback(struct i2c_master_module *const module)
 {
-	i2c_master_read_complete = true;
+	i2c_xfer_complete(I2C_XFER_DONE);
+}
+
+static void i2c_master_error_callback(struct i2c_master_module *const module)
+{
+	i2c_xfer_complete(I2C_XFER_ERROR);
+}
+
+void i2c_get_stats(struct i2c_stats *pstats)
+{
+	system_interrupt_enter_critical_section();
+	*pstats = i2c_stats;
+	system_interrupt_leave_critical_section();
+}
+
+struct i2c_sensor *i2c_get_sensor(int idx)
+{
+	return idx < I2C_SENSOR_COUNT ? &i2c_sensors[idx] : NULL;
 }
 
 void i2c_local_init(void)
 {
 	struct i2c_master_config config_i2c_master;
+	uint32_t now = get_jiffies();
+	int i;
+	
 	i2c_master_get_config_defaults(&config_i2c_master);
 	config_i2c_master.buffer_timeout = 65535;
 	config_i2c_master.pinmux_pad0 = CFG_I2C_SERCOM_PINMUX_PAD0;
@@ -111,94 +209,92 @@ void i2c_local_init(void)
 	i2c_master_enable_callback(&i2c_master_instance,I2C_MASTER_CALLBACK_WRITE_COMPLETE);
 	i2c_master_register_callback(&i2c_master_instance, i2c_master_read_complete_callback, I2C_MASTER_CALLBACK_READ_COMPLETE);
 	i2c_master_enable_callback(&i2c_master_instance,I2C_MASTER_CALLBACK_READ_COMPLETE);
+	i2c_master_register_callback(&i2c_master_instance, i2c_master_error_callback, I2C_MASTER_CALLBACK_ERROR);
+	i2c_master_enable_callback(&i2c_master_instance,I2C_MASTER_CALLBACK_ERROR);
 	
-	ioport_set_pin_dir(CFG_RESET_SHT31, IOPORT_DIR_OUTPUT);
-	ioport_set_pin_level(CFG_RESET_SHT31, IOPORT_PIN_LEVEL_LOW);
-	
-	send_buffer[0] = 0x24;
-	send_buffer[1] = 0x0B;
-	i2c_master_write(send_buffer, 2, CFG_I2C_ADDRESS_T_H);
-}
-
-
-static int i2c_master_write (uint8_t *write_buffer, uint16_t data_length, uint16_t slave_address)
-{
-	wr_packet.data			= write_buffer;
-	wr_packet.address		= slave_address;
-	wr_packet.data_length	= data_length;
-	
-	if(STATUS_OK!=i2c_master_write_packet_job(&i2c_master_instance, &wr_packet))
-	{
-		return -1;
-	}
-	
-	i2c_master_write_complete = false;
-	cnt_i2c_master_timeout = 0;
-	
-	
-	while(i2c_master_write_complete == false)
-	{
-		delay_cycles_ms(1);
-		if(cnt_i2c_master_timeout > CFG_I2C_MASTER_TIMEOUT)
-		{
-			i2c_master_write_complete = true;
-			return -1;
-		}
-		else
-		{
-			cnt_i2c_master_timeout++;
+	/* Driver set-up transactions run once interrupts are enabled */
+	for (i = 0; i < I2C_SENSOR_COUNT; i++) {
+		i2c_sensors[i].state = I2C_SENSOR_IDLE;
+		i2c_sensors[i].next = now + i2c_sensors[i].period;
+		if (i2c_sensors[i].driver->init) {
+			i2c_sensors[i].driver->init(&i2c_sensors[i]);
 		}
 	}
-	return 0;
+	i2c_last_rate = now;
 }
 
-
-static int i2c_master_read (uint8_t *read_buffer, uint16_t data_length, uint16_t slave_address)
+/*
+ * Sensor state machine: never waits, it is advanced by the I2C task
+ * period and by the transaction completion wake-ups. The samples of all
+ * sensors that are due are queued back to back.
+ */
+static void i2c_sensor_poll(struct i2c_sensor *sensor, uint32_t now)
 {
-	rd_packet.address     = slave_address;
-	rd_packet.data_length = data_length;
-	rd_packet.data        = read_buffer;
-	
-	if(STATUS_OK!=i2c_master_read_packet_job(&i2c_master_instance, &rd_packet))
-	{
-		return -1;
-	}
-	
-	i2c_master_read_complete = false;
-	cnt_i2c_master_timeout = 0;
-	
+	uint16_t delay;
+	int ret;
 	
-	while(i2c_master_read_complete == false)
-	{
-		delay_cycles_ms(1);
-		if(cnt_i2c_master_timeout > CFG_I2C_MASTER_TIMEOUT)
-		{
-			i2c_master_read_complete = true;//Also set true in the i2c_master_write_complete_callback
-			return -1;
-		}
-		else
-		{
-			cnt_i2c_master_timeout++;
-		}
+	switch (sensor->state) {
+		case I2C_SENSOR_IDLE:
+			if (time_after_eq(now, sensor->next)) {
+				sensor->next += sensor->period;
+				if (time_after(now, sensor->next)) {
+					/* Late (e.g. after a long command): don't catch up */
+					sensor->next = now + sensor->period;
+				}
+				sensor->last = NULL;
+				sensor->driver->sample(sensor);
+				sensor->state = I2C_SENSOR_BUSY;
+			}
+			break;
+		case I2C_SENSOR_BUSY:
+			if (sensor->last && sensor->last->status == I2C_XFER_PENDING) {
+				break;
+			}
+			ret = sensor->driver->convert(sensor);
+			if (ret == I2C_SENSOR_MORE) {
+				break;
+			}
+			sensor->samples++;
+			sensor->state = I2C_SENSOR_IDLE;
+			if (ret < 0) {
+				sensor->faults++;
+				if (sensor->driver->recover) {
+					sensor->state = I2C_SENSOR_RECOVER;
+					sensor->step = 0;
+					sensor->timer = now;
+				}
+			}
+			break;
+		case I2C_SENSOR_RECOVER:
+			if (time_after_eq(now, sensor->timer)) {
+				delay = sensor->driver->recover(sensor, sensor->step++);
+				if (delay) {
+					/* Strictly later: the current millisecond has already started */
+					sensor->timer = now + delay + 1;
+				} else {
+					sensor->state = I2C_SENSOR_IDLE;
+				}
+			}
+			break;
 	}
-	return 0;
-}
-
-static void i2c_local_sync_to_modbus(void)
-{
-	modbus_set_input_reg(INPUT_REG__VOLTAGE_SENSOR_SPEED_3_2, ((ina226_voltage)>>16 & 0xFFFF));
-	modbus_set_input_reg(INPUT_REG__VOLTAGE_SENSOR_SPEED_1_0, ((ina226_voltage) & 0xFFFF));
-	modbus_set_input_reg(INPUT_REG__CURRENT_SENSOR, (uint16_t)(ina226_current));
-	modbus_set_input_reg(INPUT_REG__TEMP_SENSOR, t_h_temperature);
-	modbus_set_input_reg(INPUT_REG__HUMIDITY_SENSOR, t_h_humidity);
 }
 
 void do_i2c_local(void)
 {
-	if (get_jiffies() - ina226_1sec_timer >= 1000) {
-		ina226_1sec_timer = get_jiffies();
-		i2c_get_values();
-		i2c_local_sync_to_modbus();
+	uint32_t now = get_jiffies();
+	int i;
+	
+	i2c_check_timeout();
+	for (i = 0; i < I2C_SENSOR_COUNT; i++) {
+		i2c_sensor_poll(&i2c_sensors[i], now);
+	}
+	
+	if (now - i2c_last_rate >= 1000) {
+		i2c_last_rate = now;
+		system_interrupt_enter_critical_section();
+		i2c_stats.busy_percent = i2c_busy_us / 10000;
+		i2c_busy_us = 0;
+		system_interrupt_leave_critical_section();
 	}
 }
 
@@ -6,10 +6,94 @@
  */ 
 
 
-#ifndef INA226_H_
-#define INA226_H_
+#ifndef I2C_LOCAL_H_
+#define I2C_LOCAL_H_
+
+#include "config.h"
+
+enum i2c_xfer_status {
+	I2C_XFER_DONE,
+	I2C_XFER_PENDING,
+	I2C_XFER_ERROR,
+	I2C_XFER_TIMEOUT
+};
+
+/* I2C transaction: write wr_len bytes (if any), then read rd_len bytes (if any) */
+struct i2c_xfer {
+	uint8_t address;
+	uint8_t *wr_buf;
+	uint8_t wr_len;
+	uint8_t *rd_buf;
+	uint8_t rd_len;
+	volatile enum i2c_xfer_status status;
+	struct i2c_xfer *next;
+};
+
+#define I2C_SENSOR_XFERS		6		/* Transactions per sensor */
+#define I2C_SENSOR_BUF_SIZE		20		/* Transaction buffer bytes per sensor */
+
+#define I2C_SENSOR_MORE			1		/* convert(): more transactions queued, call again when complete */
+
+struct i2c_sensor;
+
+/* Sensor driver (see CFG_I2C_SENSORS) */
+struct i2c_sensor_driver {
+	/* Set up the transactions, queue any configuration writes (optional) */
+	void (*init)(struct i2c_sensor *sensor);
+	/* Queue the transactions of one sample with i2c_sensor_submit() */
+	void (*sample)(struct i2c_sensor *sensor);
+	/*
+	 * Sample transactions complete: convert and publish the readings.
+	 * Returns 0, < 0 if the sensor failed or I2C_SENSOR_MORE.
+	 */
+	int (*convert)(struct i2c_sensor *sensor);
+	/* Recovery after a failure (optional): run a step, return the ms to wait before the next one, 0 when done */
+	uint16_t (*recover)(struct i2c_sensor *sensor, uint8_t step);
+};
+
+struct i2c_sensor {
+	const struct i2c_sensor_driver *driver;
+	const char *name;
+	uint8_t address;
+	uint16_t period;						/* Sample period (ms) */
+	uint16_t input_reg;						/* First MODBUS input register of the readings */
+	uint16_t aux_input_reg;					/* Further readings not adjacent to input_reg (driver specific) */
+	uint16_t discrete_input;				/* First MODBUS discrete input of the "broken" flags */
+	uint8_t state;
+	uint8_t step;							/* Recovery step */
+	uint32_t next;							/* Next sample (jiffies) */
+	uint32_t timer;							/* Next recovery step (jiffies) */
+	struct i2c_xfer *last;					/* Last transaction of the sample */
+	uint32_t samples;
+	uint32_t faults;
+	struct i2c_xfer xfer[I2C_SENSOR_XFERS];	/* Driver data */
+	uint8_t buf[I2C_SENSOR_BUF_SIZE];
+};
+
+#define CFG_I2C_SENSOR(_idx, _name, _driver, _address, _period, _input_reg, _aux_input_reg, _discrete_input) \
+	_idx,
+
+enum i2c_sensor_idx {
+	CFG_I2C_SENSORS
+	I2C_SENSOR_COUNT
+};
+
+#undef CFG_I2C_SENSOR
+
+/* Bus counters */
+struct i2c_stats {
+	uint32_t xfers;			/* Completed transactions */
+	uint32_t errors;		/* NACKs, bus errors */
+	uint32_t timeouts;		/* Transactions aborted after CFG_I2C_MASTER_TIMEOUT */
+	uint32_t busy_percent;	/* Bus utilization over the last second */
+};
 
 void do_i2c_local(void);
 void i2c_local_init(void);
+void i2c_submit(struct i2c_xfer *xfer);
+enum i2c_xfer_status i2c_transfer(struct i2c_xfer *xfer);
+void i2c_sensor_submit(struct i2c_sensor *sensor, struct i2c_xfer *xfer);
+struct i2c_sensor *i2c_get_sensor(int idx);
+void i2c_get_stats(struct i2c_stats *pstats);
 
-#endif /* INA226_H_ */
\ No newline at end of file
+#endif /* I2C_LOCAL_H_ */
\ No newline at end of file
@@ -0,0 +1,209 @@
+/*
+ * ina226.c: INA226 current/voltage/power monitor driver
+ *
+ * Created: 10/16/2026 5:02:44 PM
+ *  Author: E1210640
+ *
+ * Readings: input registers input_reg+0/+1 (voltage, mV, 32 bits),
+ * input_reg+2 (current, mA) and aux_input_reg+0/+1 (power, mW, 32 bits);
+ * discrete inputs discrete_input+0/+1 (voltage/current sensor broken).
+ *
+ * The INA226 converts continuously with hardware averaging
+ * (HOLD_REG__INA226_AVERAGING/CONVERSION_TIME). Each sample reads the
+ * Mask/Enable register first: the readings are only fetched when the
+ * Conversion Ready flag reports a new averaged result.
+ */ 
+
+#include <asf.h>
+
+#include "config.h"
+#include "ina226.h"
+#include "modbus.h"
+#include "fixp.h"
+
+#ifndef BOOTLOADER
+
+#define INA226_REG_CONFIG			0x00
+#define INA226_REG_SHUNT_VOLTAGE	0x01
+#define INA226_REG_BUS_VOLTAGE		0x02
+#define INA226_REG_POWER			0x03
+#define INA226_REG_CALIBRATION		0x05
+#define INA226_REG_MASK_ENABLE		0x06
+
+#define INA226_CONFIG_AVG_SHIFT		9
+#define INA226_CONFIG_VBUSCT_SHIFT	6
+#define INA226_CONFIG_VSHCT_SHIFT	3
+#define INA226_CONFIG_MODE_CONT		0x0007		/* Shunt and bus, continuous */
+#define INA226_MASK_ENABLE_CVRF		0x0008		/* Conversion Ready */
+
+/* Transactions */
+#define INA226_XFER_CONFIG			0
+#define INA226_XFER_CALIBRATION		1
+#define INA226_XFER_MASK_ENABLE		2
+#define INA226_XFER_CURRENT			3
+#define INA226_XFER_VOLTAGE			4
+#define INA226_XFER_POWER			5
+
+/* Buffer layout */
+#define INA226_BUF_CONFIG			0			/* Register, value (3 bytes) */
+#define INA226_BUF_CALIBRATION		3			/* Register, value (3 bytes) */
+#define INA226_BUF_REGS				6			/* Register pointers of the reads (4 bytes) */
+#define INA226_BUF_DATA				10			/* Read data (4 x 2 bytes) */
+#define INA226_BUF_CONFIGURED		18			/* CONFIG/CALIBRATION written */
+
+static const uint16_t ina226_averages[8] = { 1, 4, 16, 64, 128, 256, 512, 1024 };
+static const uint16_t ina226_conversion_us[8] = { 140, 204, 332, 588, 1100, 2116, 4156, 8244 };
+
+/* Largest table entry <= val (0: default) */
+static uint16_t ina226_code(const uint16_t *table, uint16_t val, uint16_t def)
+{
+	uint16_t code = 0;
+	
+	if (!val) {
+		val = def;
+	}
+	while (code < 7 && table[code + 1] <= val) {
+		code++;
+	}
+	
+	return code;
+}
+
+/* CONFIG register value for the averaging settings in the holding registers */
+static uint16_t ina226_config(void)
+{
+	uint16_t avg = ina226_code(ina226_averages, modbus_get_holding_reg(HOLD_REG__INA226_AVERAGING),
+		CFG_MODBUS_HLD_INA226_AVERAGING);
+	uint16_t ct = ina226_code(ina226_conversion_us, modbus_get_holding_reg(HOLD_REG__INA226_CONVERSION_TIME),
+		CFG_MODBUS_HLD_INA226_CONVERSION_TIME);
+	
+	return (avg << INA226_CONFIG_AVG_SHIFT) | (ct << INA226_CONFIG_VBUSCT_SHIFT) | (ct << INA226_CONFIG_VSHCT_SHIFT)
+		| INA226_CONFIG_MODE_CONT;
+}
+
+static void ina226_configure(struct i2c_sensor *sensor);
+
+static uint16_t ina226_data(struct i2c_sensor *sensor, int xfer)
+{
+	uint8_t *data = sensor->xfer[xfer].rd_buf;
+	
+	return (data[0] << 8) | data[1];
+}
+
+static void ina226_init(struct i2c_sensor *sensor)
+{
+	static const uint8_t regs[4] = { INA226_REG_MASK_ENABLE, INA226_REG_SHUNT_VOLTAGE, INA226_REG_BUS_VOLTAGE, INA226_REG_POWER };
+	struct i2c_xfer *xfer;
+	int i;
+	
+	sensor->buf[INA226_BUF_CONFIG] = INA226_REG_CONFIG;
+	sensor->xfer[INA226_XFER_CONFIG].wr_buf = &sensor->buf[INA226_BUF_CONFIG];
+	sensor->xfer[INA226_XFER_CONFIG].wr_len = 3;
+	sensor->buf[INA226_BUF_CALIBRATION] = INA226_REG_CALIBRATION;
+	sensor->buf[INA226_BUF_CALIBRATION+1] = CFG_INA226_CALIBRATION >> 8;
+	sensor->buf[INA226_BUF_CALIBRATION+2] = CFG_INA226_CALIBRATION & 0xFF;
+	sensor->xfer[INA226_XFER_CALIBRATION].wr_buf = &sensor->buf[INA226_BUF_CALIBRATION];
+	sensor->xfer[INA226_XFER_CALIBRATION].wr_len = 3;
+	
+	/* Register reads: pointer write, then 2 bytes */
+	for (i = 0; i < 4; i++) {
+		xfer = &sensor->xfer[INA226_XFER_MASK_ENABLE + i];
+		sensor->buf[INA226_BUF_REGS + i] = regs[i];
+		xfer->wr_buf = &sensor->buf[INA226_BUF_REGS + i];
+		xfer->wr_len = 1;
+		xfer->rd_buf = &sensor->buf[INA226_BUF_DATA + 2*i];
+		xfer->rd_len = 2;
+	}
+	
+	/* Start converting, so that the first sample has a result */
+	sensor->buf[INA226_BUF_CONFIGURED] = 0;
+	ina226_configure(sensor);
+}
+
+/* (Re)program the averaging if needed (this restarts the conversion) */
+static void ina226_configure(struct i2c_sensor *sensor)
+{
+	uint16_t config = ina226_config();
+	
+	if (!sensor->buf[INA226_BUF_CONFIGURED]
+			|| config != ((sensor->buf[INA226_BUF_CONFIG+1] << 8) | sensor->buf[INA226_BUF_CONFIG+2])) {
+		sensor->buf[INA226_BUF_CONFIG+1] = config >> 8;
+		sensor->buf[INA226_BUF_CONFIG+2] = config & 0xFF;
+		i2c_sensor_submit(sensor, &sensor->xfer[INA226_XFER_CONFIG]);
+		i2c_sensor_submit(sensor, &sensor->xfer[INA226_XFER_CALIBRATION]);
+		sensor->buf[INA226_BUF_CONFIGURED] = 1;
+	}
+}
+
+static void ina226_sample(struct i2c_sensor *sensor)
+{
+	ina226_configure(sensor);
+	i2c_sensor_submit(sensor, &sensor->xfer[INA226_XFER_MASK_ENABLE]);
+}
+
+static int ina226_convert(struct i2c_sensor *sensor)
+{
+	uint32_t current = 0, voltage = 0, power = 0;
+	uint16_t regs[3];
+	int ret = 0;
+	
+	if (sensor->last == &sensor->xfer[INA226_XFER_MASK_ENABLE]) {
+		if (sensor->xfer[INA226_XFER_CONFIG].status != I2C_XFER_DONE
+				|| sensor->xfer[INA226_XFER_CALIBRATION].status != I2C_XFER_DONE) {
+			/* Write the configuration again on the next sample */
+			sensor->buf[INA226_BUF_CONFIGURED] = 0;
+		}
+		if (sensor->xfer[INA226_XFER_MASK_ENABLE].status == I2C_XFER_DONE) {
+			if (!(ina226_data(sensor, INA226_XFER_MASK_ENABLE) & INA226_MASK_ENABLE_CVRF)) {
+				/* No new averaged result yet: keep the last readings */
+				return 0;
+			}
+			i2c_sensor_submit(sensor, &sensor->xfer[INA226_XFER_CURRENT]);
+			i2c_sensor_submit(sensor, &sensor->xfer[INA226_XFER_VOLTAGE]);
+			i2c_sensor_submit(sensor, &sensor->xfer[INA226_XFER_POWER]);
+			return I2C_SENSOR_MORE;
+		}
+		/* No answer: report both channels broken */
+		sensor->xfer[INA226_XFER_CURRENT].status = I2C_XFER_ERROR;
+		sensor->xfer[INA226_XFER_VOLTAGE].status = I2C_XFER_ERROR;
+		sensor->xfer[INA226_XFER_POWER].status = I2C_XFER_ERROR;
+		sensor->buf[INA226_BUF_CONFIGURED] = 0;
+	}
+	
+	if (sensor->xfer[INA226_XFER_CURRENT].status == I2C_XFER_DONE) {
+		current = fixp_convert(ina226_data(sensor, INA226_XFER_CURRENT), CFG_INA226_CURRENT_NUM, CFG_INA226_CURRENT_DEN, 0);
+		modbus_set_discrete_input(sensor->discrete_input + 1, 0);
+	} else {
+		modbus_set_discrete_input(sensor->discrete_input + 1, 1);
+		ret = -1;
+	}
+	if (sensor->xfer[INA226_XFER_VOLTAGE].status == I2C_XFER_DONE) {
+		voltage = fixp_convert(ina226_data(sensor, INA226_XFER_VOLTAGE), CFG_INA226_VOLTAGE_NUM, CFG_INA226_VOLTAGE_DEN, 0);
+		modbus_set_discrete_input(sensor->discrete_input, 0);
+	} else {
+		modbus_set_discrete_input(sensor->discrete_input, 1);
+		ret = -1;
+	}
+	if (sensor->xfer[INA226_XFER_POWER].status == I2C_XFER_DONE) {
+		power = fixp_scale(ina226_data(sensor, INA226_XFER_POWER), CFG_INA226_POWER_NUM, CFG_INA226_POWER_DEN);
+	}
+	
+	/* Publish the readings as one unit */
+	regs[0] = (voltage >> 16) & 0xFFFF;
+	regs[1] = voltage & 0xFFFF;
+	regs[2] = (uint16_t)current;
+	modbus_set_input_regs(sensor->input_reg, regs, 3);
+	regs[0] = (power >> 16) & 0xFFFF;
+	regs[1] = power & 0xFFFF;
+	modbus_set_input_regs(sensor->aux_input_reg, regs, 2);
+	
+	return ret;
+}
+
+const struct i2c_sensor_driver ina226_driver = {
+	.init = ina226_init,
+	.sample = ina226_sample,
+	.convert = ina226_convert,
+};
+
+#endif /* BOOTLOADER */
\ No newline at end of file
@@ -0,0 +1,16 @@
+/*
+ * ina226.h
+ *
+ * Created: 10/16/2026 5:02:44 PM
+ *  Author: E1210640
+ */ 
+
+
+#ifndef INA226_H_
+#define INA226_H_
+
+#include "i2c_local.h"
+
+extern const struct i2c_sensor_driver ina226_driver;
+
+#endif /* INA226_H_ */
\ No newline at end of file
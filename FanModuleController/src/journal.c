@@ -0,0 +1,246 @@
+/*
+ * journal.c: counter journal in the SPI Flash
+ *
+ * Created: 10/16/2026 8:02:41 PM
+ *  Author: E1210640
+ *
+ * The counters (operating minutes, ...) are appended as records to the
+ * sectors of CFG_JOURNAL_BLOCKS Flash blocks, used in turn as a ring:
+ * every record holds all the counters, a sequence number and a CRC, and
+ * is programmed into erased cells, so an update is one page program and
+ * the Flash wears evenly. When a sector is full, the next one continues
+ * the sequence. A sector erase takes up to 300 ms, so it is not done by
+ * journal_set(): journal_poll() erases the next sector in the background
+ * once the current one is half full, and a record that finds no erased
+ * slot stays in RAM until the erase is done. At start-up, the newest sector
+ * is the one whose first record has the highest sequence number, and its
+ * newest valid record is found by a binary search for the first erased
+ * slot; records torn by a power cut fail their CRC and are skipped.
+ */ 
+
+#include <asf.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "config.h"
+#include "spi_flash.h"
+#include "crc.h"
+#include "uart.h"
+#include "journal.h"
+
+#ifndef BOOTLOADER
+
+#define JOURNAL_ERASED		0xFFFFFFFF
+
+/* Record (its size must divide the Flash page size) */
+struct journal_record {
+	uint32_t seq;								/* Incremented by each record (never JOURNAL_ERASED) */
+	uint32_t counters[JOURNAL_COUNTERS];
+	uint16_t crc;								/* MODBUS CRC16 of the fields above */
+	uint16_t reserved;
+};
+
+static struct journal_record journal_last;		/* Newest record */
+static uint32_t journal_sector_size;
+static uint16_t journal_sectors;				/* Sectors in the CFG_JOURNAL_BLOCKS blocks */
+static uint16_t journal_sector;					/* Sector of the newest record */
+static uint16_t journal_slot;					/* Next free slot in that sector */
+static uint8_t journal_ok;
+static uint8_t journal_next_ready;				/* The sector after journal_sector is erased */
+static uint8_t journal_erasing;					/* Erase of that sector in progress */
+static uint8_t journal_pending;					/* journal_last is not written yet */
+
+#define JOURNAL_SLOTS		(journal_sector_size / sizeof(struct journal_record))
+#define JOURNAL_ADDR(_sector, _slot)	(CFG_JOURNAL_OFFSET + (_sector)*journal_sector_size + (_slot)*sizeof(struct journal_record))
+
+static uint16_t journal_crc(const struct journal_record *rec)
+{
+	return modbus_crc16((const uint8_t *)rec, offsetof(struct journal_record, crc));
+}
+
+/* Read a slot: 1 if it holds a valid record, 0 if fully erased, -1 if invalid (e.g. torn) or unreadable */
+static int journal_read(uint16_t sector, uint16_t slot, struct journal_record *rec)
+{
+	const uint8_t *p = (const uint8_t *)rec;
+	unsigned int i;
+	
+	if (spi_flash_read(JOURNAL_ADDR(sector, slot), (uint8_t *)rec, sizeof(*rec)) < 0) {
+		return -1;
+	}
+	for (i = 0; i < sizeof(*rec) && p[i] == 0xFF; i++)
+		;
+	if (i == sizeof(*rec)) {
+		return 0;
+	}
+	
+	return rec->seq != JOURNAL_ERASED && journal_crc(rec) == rec->crc ? 1 : -1;
+}
+
+/*
+ * Find the newest valid record of a sector: its slot, or -1. *free_slot is
+ * the first fully erased slot: the next record goes there, never over a
+ * partly programmed (torn) slot.
+ */
+static int journal_scan_sector(uint16_t sector, struct journal_record *rec, uint16_t *free_slot)
+{
+	int lo = 0, hi = JOURNAL_SLOTS, mid;
+	
+	/* Slots are written in order: binary search for the first erased one */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (journal_read(sector, mid, rec) == 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	*free_slot = lo;
+	/* Skip back over the records torn by a power cut */
+	while (--lo >= 0) {
+		if (journal_read(sector, lo, rec) > 0) {
+			return lo;
+		}
+	}
+	
+	return -1;
+}
+
+int journal_init(void)
+{
+	struct journal_record rec;
+	uint32_t newest_seq = 0;
+	int sector, newest = -1, slot;
+	uint16_t free_slot;
+	
+	journal_ok = 0;
+	if (spi_flash_get_block_size() < 0) {
+		PRINTF("JOURNAL: no SPI Flash\r\n");
+		return -1;
+	}
+	journal_sector_size = spi_flash_get_sector_size();
+	journal_sectors = CFG_JOURNAL_BLOCKS * (spi_flash_get_block_size() / journal_sector_size);
+	memset(&journal_last, 0, sizeof(journal_last));
+	journal_slot = JOURNAL_SLOTS;	/* No record yet: the first one goes to sector 0, once erased */
+	journal_next_ready = 0;
+	journal_erasing = 0;
+	journal_pending = 0;
+	journal_sector = journal_sectors - 1;
+	/* Newest sector: the highest sequence number in a first slot (a torn first record makes the sector empty) */
+	for (sector = 0; sector < journal_sectors; sector++) {
+		if (journal_read(sector, 0, &rec) > 0 && (newest < 0 || (int32_t)(rec.seq - newest_seq) > 0)) {
+			newest = sector;
+			newest_seq = rec.seq;
+		}
+	}
+	if (newest >= 0) {
+		slot = journal_scan_sector(newest, &rec, &free_slot);
+		if (slot >= 0) {
+			journal_last = rec;
+			journal_sector = newest;
+			journal_slot = free_slot;
+		}
+	}
+	journal_ok = 1;
+	if (newest >= 0) {
+		PRINTF("JOURNAL: record %lu in sector %u\r\n", journal_last.seq, journal_sector);
+	} else {
+		PRINTF("JOURNAL: empty\r\n");
+	}
+	
+	return journal_set(JOURNAL_BOOTS, journal_last.counters[JOURNAL_BOOTS] + 1);
+}
+
+/* 1 if the journal is usable; 0 if there is no SPI Flash */
+int journal_valid(void)
+{
+	return journal_ok;
+}
+
+uint32_t journal_get(enum journal_counter idx)
+{
+	return journal_last.counters[idx];
+}
+
+/* Write the pending record, unless it has to wait for the erase of the next sector */
+static int journal_flush(void)
+{
+	if (!journal_pending || journal_erasing) {
+		return 0;
+	}
+	if (journal_slot >= JOURNAL_SLOTS) {
+		if (!journal_next_ready) {
+			return 0;
+		}
+		/* Sector full: continue in the next one (the newest record stays in the old one until then) */
+		journal_sector = (journal_sector + 1) % journal_sectors;
+		journal_slot = 0;
+		journal_next_ready = 0;
+	}
+	if (spi_flash_program(JOURNAL_ADDR(journal_sector, journal_slot), (uint8_t *)&journal_last, sizeof(journal_last)) < 0) {
+		return -1;
+	}
+	journal_slot++;
+	journal_pending = 0;
+	
+	return 0;
+}
+
+/* Update a counter: appends a record, now or after the erase of the next sector (main loop only) */
+int journal_set(enum journal_counter idx, uint32_t val)
+{
+	struct journal_record rec = journal_last;
+	
+	if (!journal_ok) {
+		return -1;
+	}
+	rec.seq++;
+	if (rec.seq == JOURNAL_ERASED) {
+		rec.seq = 1;
+	}
+	rec.counters[idx] = val;
+	rec.crc = journal_crc(&rec);
+	rec.reserved = 0xFFFF;
+	journal_last = rec;
+	journal_pending = 1;
+	
+	return journal_flush();
+}
+
+/* Background step (main loop): erase the next sector ahead of time, without waiting */
+void journal_poll(void)
+{
+	int busy;
+	
+	if (!journal_ok) {
+		return;
+	}
+	if (journal_erasing) {
+		busy = spi_flash_busy();
+		if (busy > 0) {
+			return;
+		}
+		journal_erasing = 0;
+		journal_next_ready = (busy == 0);
+	} else if (!journal_next_ready && journal_slot >= JOURNAL_SLOTS/2) {
+		if (spi_flash_erase_sector_start(JOURNAL_ADDR((journal_sector + 1) % journal_sectors, 0)) == 0) {
+			journal_erasing = 1;
+		}
+		return;
+	}
+	journal_flush();
+}
+
+void journal_print(void)
+{
+	if (!journal_ok) {
+		PRINTF("No journal\r\n");
+		return;
+	}
+	PRINTF("Record %lu%s, sector %u/%u, slot %u/%lu\r\n", journal_last.seq, journal_pending ? " (pending)" : "",
+		journal_sector, journal_sectors, journal_slot, JOURNAL_SLOTS);
+	PRINTF("Next sector: %s\r\n", journal_erasing ? "erasing" : journal_next_ready ? "erased" : "not erased");
+	PRINTF("Operating minutes: %lu\r\n", journal_last.counters[JOURNAL_OPERATING_MINUTES]);
+	PRINTF("Boots: %lu\r\n", journal_last.counters[JOURNAL_BOOTS]);
+}
+
+#endif /* BOOTLOADER */
\ No newline at end of file
@@ -0,0 +1,26 @@
+/*
+ * journal.h: counter journal in the SPI Flash
+ *
+ * Created: 10/16/2026 8:02:41 PM
+ *  Author: E1210640
+ */ 
+
+
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+/* Journaled counters */
+enum journal_counter {
+	JOURNAL_OPERATING_MINUTES,
+	JOURNAL_BOOTS,
+	JOURNAL_COUNTERS
+};
+
+int journal_init(void);
+int journal_valid(void);
+uint32_t journal_get(enum journal_counter idx);
+int journal_set(enum journal_counter idx, uint32_t val);
+void journal_poll(void);
+void journal_print(void);
+
+#endif /* JOURNAL_H_ */
\ No newline at end of file
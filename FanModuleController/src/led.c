@@ -13,8 +13,6 @@
 
 #ifndef BOOTLOADER
 
-static uint32_t last_led;
-
 void do_led(void)
 {
 	static uint8_t init_done;
@@ -31,63 +29,59 @@ void do_led(void)
 	}
 	
 
-	if (get_jiffies() - last_led >= 125) {
-		last_led = get_jiffies();
-		
-		if(toggle_time > 3)
-		{
-			led_toggle_value_slow = !led_toggle_value_slow; //common toggle value for red LED and green LED for synch blinking.
-			toggle_time = 0;
-		}
-		else
-		{
-			toggle_time++;
-		}
-		
-		led_toggle_value_fast = !led_toggle_value_fast; //common toggle value for red LED and green LED for synch blinking.
-		
-		switch(modbus_get_holding_reg(HOLD_REG__GREEN_LED))
-		{
-			case 0: ioport_set_pin_level(CFG_LED_GREEN, IOPORT_PIN_LEVEL_HIGH);
-					break;
-
-			case 1: ioport_set_pin_level(CFG_LED_GREEN, led_toggle_value_slow);
-					break;
-					
-			case 2: ioport_set_pin_level(CFG_LED_GREEN, led_toggle_value_fast);
-					break;		
-			
-			case 3:	ioport_set_pin_level(CFG_LED_GREEN, IOPORT_PIN_LEVEL_LOW);
-					break;
+	if(toggle_time > 3)
+	{
+		led_toggle_value_slow = !led_toggle_value_slow; //common toggle value for red LED and green LED for synch blinking.
+		toggle_time = 0;
+	}
+	else
+	{
+		toggle_time++;
+	}
+	
+	led_toggle_value_fast = !led_toggle_value_fast; //common toggle value for red LED and green LED for synch blinking.
+	
+	switch(modbus_get_holding_reg(HOLD_REG__GREEN_LED))
+	{
+		case 0: ioport_set_pin_level(CFG_LED_GREEN, IOPORT_PIN_LEVEL_HIGH);
+				break;
 
-			default:ioport_set_pin_level(CFG_LED_GREEN, IOPORT_PIN_LEVEL_LOW);
-					break;
-		}
-		
+		case 1: ioport_set_pin_level(CFG_LED_GREEN, led_toggle_value_slow);
+				break;
+				
+		case 2: ioport_set_pin_level(CFG_LED_GREEN, led_toggle_value_fast);
+				break;		
 		
-		if(modbus_watchdog() == 1)
-		{
-			ioport_set_pin_level(CFG_LED_RED, led_toggle_value_fast);
-		}
-		else
-		{
-			switch(modbus_get_holding_reg(HOLD_REG__RED_LED))
-			{
-				case 0: ioport_set_pin_level(CFG_LED_RED, IOPORT_PIN_LEVEL_HIGH);
+		case 3:	ioport_set_pin_level(CFG_LED_GREEN, IOPORT_PIN_LEVEL_LOW);
 				break;
 
-				case 1: ioport_set_pin_level(CFG_LED_RED, led_toggle_value_slow);
+		default:ioport_set_pin_level(CFG_LED_GREEN, IOPORT_PIN_LEVEL_LOW);
 				break;
+	}
+	
+	
+	if(modbus_watchdog() == 1)
+	{
+		ioport_set_pin_level(CFG_LED_RED, led_toggle_value_fast);
+	}
+	else
+	{
+		switch(modbus_get_holding_reg(HOLD_REG__RED_LED))
+		{
+			case 0: ioport_set_pin_level(CFG_LED_RED, IOPORT_PIN_LEVEL_HIGH);
+			break;
 
-				case 2: ioport_set_pin_level(CFG_LED_RED, led_toggle_value_fast);
-				break;
+			case 1: ioport_set_pin_level(CFG_LED_RED, led_toggle_value_slow);
+			break;
 
-				case 3:	ioport_set_pin_level(CFG_LED_RED, IOPORT_PIN_LEVEL_LOW);
-				break;
+			case 2: ioport_set_pin_level(CFG_LED_RED, led_toggle_value_fast);
+			break;
 
-				default:ioport_set_pin_level(CFG_LED_RED, IOPORT_PIN_LEVEL_LOW);
-				break;
-			}
+			case 3:	ioport_set_pin_level(CFG_LED_RED, IOPORT_PIN_LEVEL_LOW);
+			break;
+
+			default:ioport_set_pin_level(CFG_LED_RED, IOPORT_PIN_LEVEL_LOW);
+			break;
 		}
 	}
 }
@@ -24,6 +24,9 @@
 #include "alarm.h"
 #include "led.h"
 #include "env.h"
+#include "sched.h"
+#include "journal.h"
+#include "profile.h"
 
 int main (void)
 {
@@ -58,12 +61,22 @@ int main (void)
 		reset_cause == SYSTEM_RESET_CAUSE_POR ? "POR" :
 		reset_cause == SYSTEM_RESET_CAUSE_SOFTWARE ? "SOFT" : "N/A");
 	
+	/* Started early to time the boot phases (SysTick is not masked by PRIMASK at reset) */
+	sys_timer_init();
+	
 	eeprom_init();
+	PROFILE_BOOT("eeprom");
 	env_init();
+	PROFILE_BOOT("env");
+	spi_flash_init();
+	journal_init();
+	PROFILE_BOOT("spi_flash/journal");
 	modbus_init();
+	PROFILE_BOOT("modbus");
 	fan_init();
+	PROFILE_BOOT("fan");
 	i2c_local_init();
-	spi_flash_init();
+	PROFILE_BOOT("i2c");
 	
 	/* Enable global interrupts */
 	system_interrupt_enable_global();
@@ -71,7 +84,8 @@ int main (void)
 #ifdef CFG_WDT_TIMEOUT
 	wdt_init(CFG_WDT_TIMEOUT);
 #endif
-	sys_timer_init();
+	sched_init();
+	PROFILE_BOOT("main loop");
 
 	PRINTF("\r\n");
 	
@@ -82,14 +96,7 @@ int main (void)
 	/* Main loop */
 	while (1) {
 		WDT_RESET;
-		do_env();
-		do_heartbeat(10000);
-		do_fan();
-		do_i2c_local();
-		do_cli();
-		do_modbus();
-		do_alarms();
-		do_led();
+		do_sched();
 		if(modbus_get_holding_reg(HOLD_REG__SOFTWARE_RESET)>0)
 		{
 			SYSTEM_RESET;
@@ -15,6 +15,11 @@
 #include "upgrade.h"
 #include "sys_timer.h"
 #include "env.h"
+#include "rs485.h"
+#include "sched.h"
+#include "fan.h"
+#include "journal.h"
+#include "profile.h"
 
 
 #ifndef BOOTLOADER
@@ -27,6 +32,9 @@
 #define MODBUS_FUNC_RW_MULTIPLE_REGS		23
 #define MODBUS_FUNC_MASK_WRITE_REG			22
 
+#define MODBUS_MAX_READ_REGS				125		/* Largest register count per read request */
+#define MODBUS_MAX_READ_BITS				2000	/* Largest discrete input count per read request */
+
 #define MODBUS_UPGRADE_DATA_ADDRESS			0x1000
 
 /* Upgrade function codes */
@@ -45,59 +53,74 @@
 #define MODBUS_EX_INVALID_DATA				3
 #define MODBUS_EX_DEVICE_FAILURE			4
 
+/* Received request (and, once parsed, the response built in place) */
+struct modbus_frame {
+	uint8_t buf[256];
+	uint16_t len;
+	uint8_t crc_ok;
+};
+
 static uint8_t slave_address;
-static uint8_t rtu_buf[256];
-static uint8_t rtu_ptr;
+static uint8_t slave_address_base;		/* ENV_MODBUS_SLAVE_ADDR (+ the address switches) */
+static uint8_t update_disabled;			/* ENV_DISABLE_UPDATE_ABILITY */
+
+/*
+ * Receive queue: the ISR fills rx_frames[rx_head] while the main loop parses
+ * the complete frames from rx_tail up to (but not including) rx_head.
+ */
+static struct modbus_frame rx_frames[CFG_MODBUS_RX_SLOTS];
+static volatile uint8_t rx_head;
+static volatile uint8_t rx_tail;
+static uint16_t rtu_ptr;
+static struct modbus_stats stats;
 
 static uint8_t discrete_inputs[(CFG_MODBUS_DISCRETE_INPUTS + 7)/8];
 static uint16_t input_regs[CFG_MODBUS_INPUT_REGS];
 static uint16_t holding_regs[CFG_MODBUS_HOLDING_REGS];
-static uint8_t frame_len;
+static uint32_t holding_dirty[(CFG_MODBUS_HOLDING_REGS + 31)/32];	/* Registers not saved to the EEPROM yet */
+static uint32_t holding_dirty_since;		/* Jiffies of the oldest unsaved write */
+static uint32_t holding_last_write;			/* Jiffies of the latest write */
+static uint8_t holding_dirty_any;				/* Any bit set in holding_dirty */
+static uint16_t rtu_crc;
 static uint8_t modbus_watchdog_triggered;
+static uint8_t modbus_responded;				/* A response was sent since the start-up */
 static uint32_t last_modbus_watchdog_period = 0;
 
 static struct tc_module tc_instance;
 static int baud_rate;
+static uint32_t frame_gap_us;					/* Silent interval between frames (3.5 characters) */
 static uint32_t operating_minutes;
 static uint32_t last_1_minute;
 
-/*
- * MODBUS uses a reverse CRC algorithm,
- * so we cannot use the generic crc16() function here.
- */
-static uint16_t modbus_crc16(const uint8_t *buf, uint32_t len)
-{
-	int i;
-	uint8_t c, flag;
-	uint16_t crc = 0xFFFF;
-	
-	while (len--) {
-		c = *buf++;
-		crc ^= c;
-		for (i = 0; i < 8; i++) {
-			flag = (crc & 1);
-			crc >>= 1;
-			if (flag) {
-				crc ^= 0xA001;
-			}
-		}
-	}
-
-	return crc;
-}
-
 /*
  * The following callback will be called after a silent period
  * (no characters received for 3.5 character lengths).
  */
 static void modbus_tc_callback(struct tc_module *const module_inst)
 {
+	struct modbus_frame *frame = &rx_frames[rx_head];
+	uint8_t next;
+	
 	/* Clear the status and stop the timer */
 	tc_stop_counter(&tc_instance);
 	if (rtu_ptr) {
-		/* Check if a valid frame has been received and the previous frame has been processed (frame_len == 0) */
-		if ((!*rtu_buf || *rtu_buf == slave_address) && rtu_ptr >= 5 && !frame_len) {
-			frame_len = rtu_ptr;
+		if (rtu_ptr > sizeof(frame->buf)) {
+			/* Longer than any valid MODBUS frame: drop it */
+			stats.overruns++;
+		} else if ((!frame->buf[0] || frame->buf[0] == slave_address) && rtu_ptr >= 5) {
+			next = (rx_head + 1) % CFG_MODBUS_RX_SLOTS;
+			if (next == rx_tail) {
+				/* All slots are waiting to be parsed: the slot being filled is reused */
+				stats.dropped++;
+			} else {
+				/* Running the CRC over the whole frame, including its own CRC field, yields 0 */
+				frame->crc_ok = (rtu_crc == 0);
+				frame->len = rtu_ptr;
+				rx_head = next;
+				stats.frames++;
+				rs485_rx_done();
+				sched_wake(SCHED_MODBUS);
+			}
 		}
 		rtu_ptr = 0;
 	}
@@ -116,20 +139,104 @@ static int modbus_configure_timeout(void)
 	if (silent_timeout_us < 1750) {
 		silent_timeout_us = 1750;
 	}
+	frame_gap_us = silent_timeout_us;
 	
 	/* The compare value is based on the clock generator frequency of 8 MHz */
 	return tc_set_compare_value(&tc_instance, TC_COMPARE_CAPTURE_CHANNEL_0, 8*silent_timeout_us);
 }
 
+/* Mark a holding register to be saved to the EEPROM by do_modbus() */
+static void modbus_holding_mark_dirty(uint16_t nr)
+{
+	holding_dirty[nr/32] |= 1UL << (nr & 31);
+	holding_last_write = get_jiffies();
+	if (!holding_dirty_any) {
+		holding_dirty_since = holding_last_write;
+	}
+	holding_dirty_any = 1;
+}
+
+/* Read registers stored big-endian (MODBUS byte order) in the EEPROM straight into a bank */
+static void modbus_read_eeprom_regs(uint16_t *regs, int offset, int qty)
+{
+	int i;
+	
+	if (eeprom_read((uint8_t *)regs, offset, qty*2) < 0) {
+		return;
+	}
+	for (i = 0; i < qty; i++) {
+		regs[i] = __REV16(regs[i]);
+	}
+}
+
+/* Set a holding register during the start-up, marking it to be saved if it changes */
+static void modbus_init_holding_reg(uint16_t nr, uint16_t val)
+{
+	if (holding_regs[nr] != val) {
+		holding_regs[nr] = val;
+		modbus_holding_mark_dirty(nr);
+	}
+}
+
+/* Defaults of the registers added with holding layout 1 (0x71..0x8A) */
+static void modbus_init_holding_layout(void)
+{
+	uint8_t i;
+	
+	modbus_init_holding_reg(HOLD_REG__FAN_CONTROL_MODE, CFG_MODBUS_HLD_FAN_CONTROL_MODE);
+	modbus_init_holding_reg(HOLD_REG__FAN_RPM_REQUEST, CFG_MODBUS_HLD_FAN_RPM_REQUEST);
+	modbus_init_holding_reg(HOLD_REG__FAN_PID_KP, CFG_MODBUS_HLD_FAN_PID_KP);
+	modbus_init_holding_reg(HOLD_REG__FAN_PID_KI, CFG_MODBUS_HLD_FAN_PID_KI);
+	modbus_init_holding_reg(HOLD_REG__FAN_PID_KD, CFG_MODBUS_HLD_FAN_PID_KD);
+	modbus_init_holding_reg(HOLD_REG__INA226_AVERAGING, CFG_MODBUS_HLD_INA226_AVERAGING);
+	modbus_init_holding_reg(HOLD_REG__INA226_CONVERSION_TIME, CFG_MODBUS_HLD_INA226_CONVERSION_TIME);
+	modbus_init_holding_reg(HOLD_REG__FAN_CURVE_SELECT, 0);
+	for (i = 1; i < FAN_CHANNELS; i++) {
+		modbus_init_holding_reg(HOLD_REG__FAN_N(i, FAN_HOLD_RPM_REQUEST), CFG_MODBUS_HLD_FAN_RPM_REQUEST);
+		modbus_init_holding_reg(HOLD_REG__FAN_N(i, FAN_HOLD_CURVE_SELECT), 0);
+	}
+	PRINTF("MODBUS: initialized the registers of holding layout %d\r\n", CFG_MODBUS_HOLDING_LAYOUT);
+}
+
+/* Slave address: the configured base plus the address switches */
+static uint8_t modbus_slave_address(void)
+{
+	return slave_address_base + (!ioport_get_pin_level(CFG_MODBUS_ADDRESS_4)<<3) + (!ioport_get_pin_level(CFG_MODBUS_ADDRESS_3)<<2) + (!ioport_get_pin_level(CFG_MODBUS_ADDRESS_2)<<1) + !ioport_get_pin_level(CFG_MODBUS_ADDRESS_1);
+}
+
+/* Environment change hook (the values have been range checked) */
+void modbus_env_apply(enum env_idx idx, uint32_t val)
+{
+	switch (idx) {
+		case ENV_MODBUS_BAUD_RATE:
+			PRINTF("MODBUS: changing baud rate to %lu\r\n", val);
+			baud_rate = val;
+			uart_set_baud_rate(CFG_MODBUS_CHANNEL, baud_rate);
+			modbus_configure_timeout();
+			break;
+		case ENV_MODBUS_SLAVE_ADDR:
+			slave_address_base = val;
+			break;
+		case ENV_DISABLE_UPDATE_ABILITY:
+			update_disabled = val;
+			break;
+		default:
+			break;
+	}
+}
+
 int modbus_init(void)
 {
-	uint8_t eeprom_data[(5*EEPROM_PAGE_SIZE) - 4];		/* -4 to avoid overwriting the operating hours data at the end of the page */
+	uint8_t eeprom_data[4];							/* Operating hours */
 	enum system_reset_cause reset_cause;
 	int i;
 
-	baud_rate = env_get("modbus_baud_rate");
+	baud_rate = env_get_idx(ENV_MODBUS_BAUD_RATE);
 	uart_set_baud_rate(CFG_MODBUS_CHANNEL, baud_rate);
-	slave_address = CFG_MODBUS_SLAVE_ADDRESS + (!ioport_get_pin_level(CFG_MODBUS_ADDRESS_4)<<3) + (!ioport_get_pin_level(CFG_MODBUS_ADDRESS_3)<<2) + (!ioport_get_pin_level(CFG_MODBUS_ADDRESS_2)<<1) + !ioport_get_pin_level(CFG_MODBUS_ADDRESS_1);
+	rs485_init();
+	slave_address_base = env_get_idx(ENV_MODBUS_SLAVE_ADDR);
+	update_disabled = env_get_idx(ENV_DISABLE_UPDATE_ABILITY);
+	slave_address = modbus_slave_address();
 	PRINTF("MODBUS slave address: %d\r\n", slave_address);
 	PRINTF("MODBUS baud rate: %d\r\n", baud_rate);
 
@@ -147,35 +254,8 @@ int modbus_init(void)
 	tc_enable_callback(&tc_instance, TC_CALLBACK_CC_CHANNEL0);
 	modbus_configure_timeout();
 	
-	/* Initialize part/device numbers */
-	eeprom_read(eeprom_data, CFG_EEPROM_PN_OFFSET, sizeof(eeprom_data));
-	for (i = 0; i < 46; i++) {
-		input_regs[i] = (eeprom_data[i*2] << 8) | eeprom_data[i*2+1];
-	}
-	
-	input_regs[INPUT_REG__DEVICE_PN_7_6] = input_regs[0];
-	input_regs[INPUT_REG__DEVICE_PN_5_4] = input_regs[1];
-	input_regs[INPUT_REG__DEVICE_PN_3_2] = input_regs[2];
-	input_regs[INPUT_REG__DEVICE_PN_1_0] = input_regs[3];
-	
-	input_regs[INPUT_REG__DEVICE_SN_11_10] = input_regs[4];
-	input_regs[INPUT_REG__DEVICE_SN_9_8] = input_regs[5];
-	input_regs[INPUT_REG__DEVICE_SN_7_6] = input_regs[6];
-	input_regs[INPUT_REG__DEVICE_SN_5_4] = input_regs[7];
-	input_regs[INPUT_REG__DEVICE_SN_3_2] = input_regs[8];
-	input_regs[INPUT_REG__DEVICE_SN_1_0] = input_regs[9];
-	
-	input_regs[INPUT_REG__CONTROLLER_PN_7_6] = input_regs[10];
-	input_regs[INPUT_REG__CONTROLLER_PN_5_4] = input_regs[11];
-	input_regs[INPUT_REG__CONTROLLER_PN_3_2] = input_regs[12];
-	input_regs[INPUT_REG__CONTROLLER_PN_1_0] = input_regs[13];
-	
-	input_regs[INPUT_REG__CONTROLLER_SN_11_10] = input_regs[14];
-	input_regs[INPUT_REG__CONTROLLER_SN_9_8] = input_regs[15];
-	input_regs[INPUT_REG__CONTROLLER_SN_7_6] = input_regs[16];
-	input_regs[INPUT_REG__CONTROLLER_SN_5_4] = input_regs[17];
-	input_regs[INPUT_REG__CONTROLLER_SN_3_2] = input_regs[18];
-	input_regs[INPUT_REG__CONTROLLER_SN_1_0] = input_regs[19];
+	/* Part/serial numbers: EEPROM page 0 holds them in the order of input registers 0x00..0x13 */
+	modbus_read_eeprom_regs(input_regs, CFG_EEPROM_PN_OFFSET, INPUT_REG__CONTROLLER_SN_1_0 + 1);
 	
 	char fw_number[8] = CFG_FIRMWARE_NUMBER;
 	input_regs[INPUT_REG__FIRMWARE_PN_7_6] = (fw_number[0]<<8) | fw_number[1];
@@ -207,56 +287,58 @@ int modbus_init(void)
 	input_regs[INPUT_REG__CURRENT_SENSOR] = 0;
 	input_regs[INPUT_REG__RPM_DEVIATION_1_0] = 0;
 	
-	eeprom_read(eeprom_data, CFG_EEPROM_HOLDING_OFFSET, sizeof(eeprom_data));
+	modbus_read_eeprom_regs(holding_regs, CFG_EEPROM_HOLDING_OFFSET, CFG_MODBUS_HOLDING_REGS);
 	
+	/* Registers changed below are saved at the end (only the pages that differ) */
 	reset_cause = system_get_reset_cause();
 	if (reset_cause == SYSTEM_RESET_CAUSE_WDT || reset_cause == SYSTEM_RESET_CAUSE_SOFTWARE) {
 		/* Soft/WDT reset: restore from EEPROM */
 		PRINTF("MODBUS: restoring holding registers\r\n");
-		for (i = 0; i < CFG_MODBUS_HOLDING_REGS; i++) {
-			holding_regs[i] = (eeprom_data[i*2] << 8) | eeprom_data[i*2 + 1];
-		}
-		holding_regs[HOLD_REG__SOFTWARE_RESET] = CFG_MODBUS_HLD_SOFTWARE_RESET;
+		modbus_init_holding_reg(HOLD_REG__SOFTWARE_RESET, CFG_MODBUS_HLD_SOFTWARE_RESET);
 	} else {
 		/* Power-on: initialize to default values */
-		for (i = 0; i < CFG_MODBUS_HOLDING_REGS; i++) {
-			holding_regs[i] = (eeprom_data[i*2] << 8) | eeprom_data[i*2 + 1];
-		}
-		if(env_get("first_start_done") == 0) 
+		if(env_get_idx(ENV_FIRST_START_DONE) == 0) 
 		{		
-				holding_regs[HOLD_REG__UNIT_OFF_ON] = CFG_MODBUS_HLD_UNIT_ON_OFF;
-				holding_regs[HOLD_REG__PRECONFIG_FAN_REQUEST] = CFG_MODBUS_HLD_PRECONFIG_FAN_REQUEST;
-				holding_regs[HOLD_REG__GREEN_LED] = CFG_MODBUS_HLD_GREEN_LED;
-				holding_regs[HOLD_REG__RED_LED] = CFG_MODBUS_HLD_RED_LED;
-				holding_regs[HOLD_REG__FAN_REQUEST] = holding_regs[HOLD_REG__PRECONFIG_FAN_REQUEST];
-				holding_regs[HOLD_REG__FAN_REUEST_MIN] = CFG_MODBUS_HLD_FAN_REUEST_MIN;
-				holding_regs[HOLD_REG__FAN_REUEST_MAX] = CFG_MODBUS_HLD_FAN_REUEST_MAX;
-				holding_regs[HOLD_REG__PWM_FREQUENCY] = CFG_MODBUS_HLD_PWM_FREQUENCY;
-				holding_regs[HOLD_REG__PWM_DELAY] = CFG_MODBUS_HLD_PWM_DELAY;
-				holding_regs[HOLD_REG__PULSES_PER_REVOLUTION] = CFG_MODBUS_HLD_PULSES_PER_REVOLUTION;
-				holding_regs[HOLD_REG__MODBUS_DEAD_TIME] = CFG_MODBUS_HLD_MODBUS_DEAD_TIME;
-				holding_regs[HOLD_REG__SOFTWARE_RESET] = CFG_MODBUS_HLD_SOFTWARE_RESET;
-				holding_regs[HOLD_REG__UPGRADE_FUNCTION] = CFG_MODBUS_HLD_UPGRADE_FUNCTION;
-				env_set("first_start_done", 1);
+				modbus_init_holding_reg(HOLD_REG__UNIT_OFF_ON, CFG_MODBUS_HLD_UNIT_ON_OFF);
+				modbus_init_holding_reg(HOLD_REG__PRECONFIG_FAN_REQUEST, CFG_MODBUS_HLD_PRECONFIG_FAN_REQUEST);
+				modbus_init_holding_reg(HOLD_REG__GREEN_LED, CFG_MODBUS_HLD_GREEN_LED);
+				modbus_init_holding_reg(HOLD_REG__RED_LED, CFG_MODBUS_HLD_RED_LED);
+				modbus_init_holding_reg(HOLD_REG__FAN_REQUEST, holding_regs[HOLD_REG__PRECONFIG_FAN_REQUEST]);
+				modbus_init_holding_reg(HOLD_REG__FAN_REUEST_MIN, CFG_MODBUS_HLD_FAN_REUEST_MIN);
+				modbus_init_holding_reg(HOLD_REG__FAN_REUEST_MAX, CFG_MODBUS_HLD_FAN_REUEST_MAX);
+				modbus_init_holding_reg(HOLD_REG__PWM_FREQUENCY, CFG_MODBUS_HLD_PWM_FREQUENCY);
+				modbus_init_holding_reg(HOLD_REG__PWM_DELAY, CFG_MODBUS_HLD_PWM_DELAY);
+				modbus_init_holding_reg(HOLD_REG__PULSES_PER_REVOLUTION, CFG_MODBUS_HLD_PULSES_PER_REVOLUTION);
+				modbus_init_holding_reg(HOLD_REG__MODBUS_DEAD_TIME, CFG_MODBUS_HLD_MODBUS_DEAD_TIME);
+				modbus_init_holding_reg(HOLD_REG__SOFTWARE_RESET, CFG_MODBUS_HLD_SOFTWARE_RESET);
+				modbus_init_holding_reg(HOLD_REG__UPGRADE_FUNCTION, CFG_MODBUS_HLD_UPGRADE_FUNCTION);
+				env_set_idx(ENV_FIRST_START_DONE, 1);
 				PRINTF("MODBUS: initialized to default values first start\r\n");
 		}
 		else
 		{
-				holding_regs[HOLD_REG__UNIT_OFF_ON] = CFG_MODBUS_HLD_UNIT_ON_OFF;
-				holding_regs[HOLD_REG__GREEN_LED] = CFG_MODBUS_HLD_GREEN_LED;
-				holding_regs[HOLD_REG__RED_LED] = CFG_MODBUS_HLD_RED_LED;
-				holding_regs[HOLD_REG__FAN_REQUEST] = holding_regs[HOLD_REG__PRECONFIG_FAN_REQUEST];
-				holding_regs[HOLD_REG__SOFTWARE_RESET] = CFG_MODBUS_HLD_SOFTWARE_RESET;
-				holding_regs[HOLD_REG__UPGRADE_FUNCTION] = CFG_MODBUS_HLD_UPGRADE_FUNCTION;
+				modbus_init_holding_reg(HOLD_REG__UNIT_OFF_ON, CFG_MODBUS_HLD_UNIT_ON_OFF);
+				modbus_init_holding_reg(HOLD_REG__GREEN_LED, CFG_MODBUS_HLD_GREEN_LED);
+				modbus_init_holding_reg(HOLD_REG__RED_LED, CFG_MODBUS_HLD_RED_LED);
+				modbus_init_holding_reg(HOLD_REG__FAN_REQUEST, holding_regs[HOLD_REG__PRECONFIG_FAN_REQUEST]);
+				modbus_init_holding_reg(HOLD_REG__SOFTWARE_RESET, CFG_MODBUS_HLD_SOFTWARE_RESET);
+				modbus_init_holding_reg(HOLD_REG__UPGRADE_FUNCTION, CFG_MODBUS_HLD_UPGRADE_FUNCTION);
 				PRINTF("MODBUS: restoring holding registers\r\n");
 				PRINTF("MODBUS: initialized to default values\r\n");
 		}
 
-		for (i = 0; i < CFG_MODBUS_HOLDING_REGS; i++) {
-			eeprom_data[i*2] = (holding_regs[i] >> 8) & 0xFF;
-			eeprom_data[i*2 + 1] = holding_regs[i] & 0xFF;
+		for (i = 1; i < FAN_CHANNELS; i++) {
+			modbus_init_holding_reg(HOLD_REG__FAN_N(i, FAN_HOLD_REQUEST), holding_regs[HOLD_REG__PRECONFIG_FAN_REQUEST]);
 		}
-		eeprom_write(eeprom_data, CFG_EEPROM_HOLDING_OFFSET, sizeof(eeprom_data));
+	}
+	/* Registers added after the baseline layout read as zeros on upgraded units */
+	if (env_get_idx(ENV_HOLDING_LAYOUT) < CFG_MODBUS_HOLDING_LAYOUT) {
+		modbus_init_holding_layout();
+	}
+	modbus_save_holding_regs();
+	if (env_get_idx(ENV_HOLDING_LAYOUT) < CFG_MODBUS_HOLDING_LAYOUT) {
+		/* Set after the save: a power cut in between initializes them again */
+		env_set_idx(ENV_HOLDING_LAYOUT, CFG_MODBUS_HOLDING_LAYOUT);
 	}
 	/* Initialize operating hours */
 	eeprom_read(eeprom_data, CFG_EEPROM_HOLDING_OFFSET + 5* EEPROM_PAGE_SIZE - 4, 4);
@@ -264,6 +346,13 @@ int modbus_init(void)
 	if (operating_minutes == 0xFFFFFFFF) {
 		operating_minutes = 0;
 	}
+	if (journal_valid()) {
+		/* The EEPROM copy is only used without journal, or before it was introduced */
+		if (journal_get(JOURNAL_OPERATING_MINUTES) < operating_minutes) {
+			journal_set(JOURNAL_OPERATING_MINUTES, operating_minutes);
+		}
+		operating_minutes = journal_get(JOURNAL_OPERATING_MINUTES);
+	}
 	input_regs[INPUT_REG__OPERATING_HOURS_3_2] = ((operating_minutes/60) >> 16) & 0xFFFF;
 	input_regs[INPUT_REG__OPERATING_HOURS_1_0] = (operating_minutes/60) & 0xFFFF;
 
@@ -277,99 +366,275 @@ int modbus_init(void)
 	return 0;
 }
 
-uint8_t modbus_get_discrete_input(uint16_t nr)
+/*
+ * Register banks are versioned (seqlock-style): every update makes the
+ * bank's sequence counter odd, stores the new values and makes it even
+ * again. A single register is one aligned 8/16-bit load, which is atomic
+ * on the Cortex-M0+, so single readers never lock at all. Bulk readers
+ * copy the range and retry if the counter was odd or changed meanwhile.
+ *
+ * Writers of the discrete input and input register banks run both in the
+ * main loop and in interrupt handlers (tacho gate), so they mask interrupts
+ * for the few cycles of the update only. Holding registers are written
+ * from the main loop only and are updated without masking.
+ *
+ * Bulk readers must not be called from interrupt context.
+ */
+static volatile uint16_t discrete_seq;
+static volatile uint16_t input_seq;
+static volatile uint16_t holding_seq;
+
+static inline void modbus_bank_write_begin(volatile uint16_t *seq)
+{
+	(*seq)++;
+	__DMB();
+}
+
+static inline void modbus_bank_write_end(volatile uint16_t *seq)
+{
+	__DMB();
+	(*seq)++;
+}
+
+static inline uint16_t modbus_bank_read_begin(volatile uint16_t *seq)
 {
-	uint8_t ret;
+	uint16_t start;
 	
-	system_interrupt_enter_critical_section();
-	ret = (discrete_inputs[nr/8] >> (nr & 7)) & 1;
-	system_interrupt_leave_critical_section();
+	while ((start = *seq) & 1) {
+		/* An update is in progress */
+	}
+	__DMB();
+	
+	return start;
+}
+
+static inline uint8_t modbus_bank_read_retry(volatile uint16_t *seq, uint16_t start)
+{
+	__DMB();
 	
-	return ret;
+	return *seq != start;
+}
+
+uint8_t modbus_get_discrete_input(uint16_t nr)
+{
+	return (discrete_inputs[nr/8] >> (nr & 7)) & 1;
 }
 
 void modbus_set_discrete_input(uint16_t nr, uint8_t val)
 {
 	system_interrupt_enter_critical_section();
+	modbus_bank_write_begin(&discrete_seq);
 	if (val) {
 		discrete_inputs[nr/8] |= (1 << (nr & 7));
 	} else {
 		discrete_inputs[nr/8] &= ~(1 << (nr & 7));	
 	}
+	modbus_bank_write_end(&discrete_seq);
 	system_interrupt_leave_critical_section();
 }
 
 uint16_t modbus_get_input_reg(uint16_t nr)
 {
-	uint16_t ret;
-	
-	system_interrupt_enter_critical_section();
-	ret = input_regs[nr];
-	system_interrupt_leave_critical_section();
-	
-	return ret;
+	return input_regs[nr];
 }
 
 void modbus_set_input_reg(uint16_t nr, uint16_t val)
 {
+	modbus_set_input_regs(nr, &val, 1);
+}
+
+/* Update consecutive input registers (e.g. the halves of a 32-bit value) as one unit */
+void modbus_set_input_regs(uint16_t nr, const uint16_t *val, uint16_t qty)
+{
+	if (nr + qty > CFG_MODBUS_INPUT_REGS) {
+		return;
+	}
 	system_interrupt_enter_critical_section();
-	input_regs[nr] = val;
+	modbus_bank_write_begin(&input_seq);
+	while (qty--) {
+		input_regs[nr++] = *val++;
+	}
+	modbus_bank_write_end(&input_seq);
 	system_interrupt_leave_critical_section();
 }
 
 uint16_t modbus_get_holding_reg(uint16_t nr)
 {
-	uint16_t ret;
+	return holding_regs[nr];
+}
 
-	system_interrupt_enter_critical_section();
-	ret = holding_regs[nr];
-	system_interrupt_leave_critical_section();
+/* Store a register range big-endian (MODBUS byte order) into buf */
+static void modbus_copy_regs(const uint16_t *regs, uint16_t qty, uint8_t *buf)
+{
+	while (qty--) {
+		*buf++ = *regs >> 8;
+		*buf++ = *regs++ & 0xff;
+	}
+}
+
+/*
+ * Bulk readers: snapshot a contiguous range straight into an outgoing
+ * frame. The copy is repeated if the bank was updated meanwhile, so the
+ * range is always consistent and interrupts are never masked.
+ */
+void modbus_read_discrete_inputs(uint16_t nr, uint16_t qty, uint8_t *buf)
+{
+	uint16_t i, bit, start;
+	
+	do {
+		start = modbus_bank_read_begin(&discrete_seq);
+		for (i = 0, bit = nr; i < qty; i++, bit++) {
+			if ((i & 7) == 0) {
+				buf[i/8] = 0;
+			}
+			buf[i/8] |= ((discrete_inputs[bit/8] >> (bit & 7)) & 1) << (i & 7);
+		}
+	} while (modbus_bank_read_retry(&discrete_seq, start));
+}
+
+void modbus_read_input_regs(uint16_t nr, uint16_t qty, uint8_t *buf)
+{
+	uint16_t start;
+	
+	do {
+		start = modbus_bank_read_begin(&input_seq);
+		modbus_copy_regs(&input_regs[nr], qty, buf);
+	} while (modbus_bank_read_retry(&input_seq, start));
+}
+
+void modbus_read_holding_regs(uint16_t nr, uint16_t qty, uint8_t *buf)
+{
+	uint16_t start;
 	
-	return ret;
+	do {
+		start = modbus_bank_read_begin(&holding_seq);
+		modbus_copy_regs(&holding_regs[nr], qty, buf);
+	} while (modbus_bank_read_retry(&holding_seq, start));
+}
+
+/* Holding register bank version: changes with every write */
+uint16_t modbus_get_holding_seq(void)
+{
+	return holding_seq;
 }
 
 void modbus_set_holding_reg(uint16_t nr, uint16_t val)
 {
 	uint8_t tmp[2];
 	
-	system_interrupt_enter_critical_section();
-	if (holding_regs[nr] != val) {
-		/* Save to the EEPROM holding area (cached; will only be committed before a WDT or soft reset) */
-		tmp[0] = (val >> 8) & 0xFF;
-		tmp[1] = val & 0xFF;
-		eeprom_write(tmp, CFG_EEPROM_HOLDING_OFFSET + nr*2, 2);
-		holding_regs[nr] = val;
+	tmp[0] = (val >> 8) & 0xFF;
+	tmp[1] = val & 0xFF;
+	modbus_write_holding_regs(nr, 1, tmp);
+}
+
+/* Update consecutive holding registers from big-endian (MODBUS byte order) data as one unit */
+void modbus_write_holding_regs(uint16_t nr, uint16_t qty, const uint8_t *buf)
+{
+	uint16_t i, val;
+	uint8_t changed = 0;
+	
+	for (i = 0; i < qty; i++) {
+		val = (buf[i*2] << 8) | buf[i*2 + 1];
+		if (holding_regs[nr + i] != val) {
+			/* Bump the version only on a change: the curve cache and the saves depend on it */
+			if (!changed) {
+				modbus_bank_write_begin(&holding_seq);
+				changed = 1;
+			}
+			holding_regs[nr + i] = val;
+		}
+	}
+	if (changed) {
+		modbus_bank_write_end(&holding_seq);
+		/* Only mark the registers: do_modbus() saves them once the master is done */
+		for (i = nr; i < nr + qty; i++) {
+			modbus_holding_mark_dirty(i);
+		}
 	}
-	system_interrupt_leave_critical_section();
 }
 
-static void modbus_send_response(uint8_t len)
+/* Any register of first..first+qty-1 not saved? */
+static int modbus_holding_dirty(uint16_t first, uint16_t qty)
+{
+	uint16_t i;
+	
+	for (i = first; i < first + qty; i++) {
+		if (holding_dirty[i/32] & (1UL << (i & 31))) {
+			return 1;
+		}
+	}
+	
+	return 0;
+}
+
+/*
+ * Save the changed holding registers to the EEPROM: each emulator page
+ * with a changed register is written once as a whole, then the page
+ * buffer is committed. Main loop only; interrupts stay enabled.
+ */
+void modbus_save_holding_regs(void)
+{
+	uint8_t buf[EEPROM_PAGE_SIZE];
+	uint16_t first, qty, i;
+	
+	if (!holding_dirty_any) {
+		return;
+	}
+	holding_dirty_any = 0;
+	for (first = 0; first < CFG_MODBUS_HOLDING_REGS; first += EEPROM_PAGE_SIZE/2) {
+		qty = CFG_MODBUS_HOLDING_REGS - first;
+		if (qty > EEPROM_PAGE_SIZE/2) {
+			qty = EEPROM_PAGE_SIZE/2;
+		}
+		if (!modbus_holding_dirty(first, qty)) {
+			continue;
+		}
+		for (i = first; i < first + qty; i++) {
+			holding_dirty[i/32] &= ~(1UL << (i & 31));
+		}
+		modbus_read_holding_regs(first, qty, buf);
+		/* Writing another page commits the previous one */
+		eeprom_write(buf, CFG_EEPROM_HOLDING_OFFSET + first*2, qty*2);
+		stats.saved_pages++;
+	}
+	eeprom_commit();
+}
+
+/* Save the holding registers once the writes stopped, or if they are pending for too long */
+static void modbus_save_holding_regs_policy(void)
+{
+	uint32_t now = get_jiffies();
+	
+	if (holding_dirty_any && (now - holding_last_write >= CFG_MODBUS_SAVE_IDLE
+			|| now - holding_dirty_since >= CFG_MODBUS_SAVE_MAX_DELAY)) {
+		modbus_save_holding_regs();
+	}
+}
+
+static void modbus_send_response(uint8_t *rtu_buf, uint8_t len)
 {
 	uint16_t cksum;
 	
 	cksum = modbus_crc16((const uint8_t *)rtu_buf, len + 2);
 	rtu_buf[len + 3] = cksum >> 8;
 	rtu_buf[len + 2] = cksum & 0xff;
-	/* Enable the driver and disable the receiver */
-	ioport_set_pin_level(CFG_MODBUS_DE_PIN, IOPORT_PIN_LEVEL_HIGH);
-	ioport_set_pin_level(CFG_MODBUS_RE_PIN, IOPORT_PIN_LEVEL_HIGH);
-	uart_write(CFG_MODBUS_CHANNEL, (const uint8_t *)rtu_buf, len + 4);
-	/* Disable the driver and enable the receiver */
-	ioport_set_pin_level(CFG_MODBUS_DE_PIN, IOPORT_PIN_LEVEL_LOW);
-	ioport_set_pin_level(CFG_MODBUS_RE_PIN, IOPORT_PIN_LEVEL_LOW);
+	rs485_send((const uint8_t *)rtu_buf, len + 4);
+	if (!modbus_responded) {
+		modbus_responded = 1;
+		PROFILE_BOOT("first MODBUS response");
+	}
 }
 
-static void modbus_parse_frame(void)
+static void modbus_parse_frame(struct modbus_frame *frame)
 {
-	uint16_t cksum_calc, cksum_frame;
-	uint16_t read_addr, read_qty, write_addr, write_qty, val, and_mask, or_mask, i;
+	uint8_t *rtu_buf = frame->buf;
+	uint16_t read_addr, read_qty, write_addr, write_qty, val, and_mask, or_mask;
 	uint8_t resp_len = 0, exception = 0;
 
-	cksum_calc = modbus_crc16((const uint8_t *)rtu_buf, frame_len - 2);
-	cksum_frame = (rtu_buf[frame_len - 1] << 8) | rtu_buf[frame_len - 2];
-		
-	if (cksum_calc != cksum_frame) {
+	/* The CRC has already been checked by the receive path */
+	if (!frame->crc_ok) {
 		/* Invalid checksum: discard */
+		stats.crc_errors++;
 		PRINTF("MODBUS request: invalid checksum, dropping frame\r\n");
 		return;
 	}
@@ -383,16 +648,11 @@ static void modbus_parse_frame(void)
 			read_qty = (rtu_buf[4] << 8) | rtu_buf[5];
 			if (read_addr >= CFG_MODBUS_DISCRETE_INPUTS) {
 				exception = MODBUS_EX_INVALID_ADDRESS;
-			} else if (!read_qty || read_addr + read_qty > CFG_MODBUS_DISCRETE_INPUTS) {
+			} else if (!read_qty || read_qty > MODBUS_MAX_READ_BITS || read_addr + read_qty > CFG_MODBUS_DISCRETE_INPUTS) {
 				exception = MODBUS_EX_INVALID_DATA;
 			} else {
 				rtu_buf[2] = (read_qty + 7)/8;
-				for (i = 0; i < read_qty; i++) {
-					if ((i & 7) == 0) {
-						rtu_buf[3 + i/8] = 0;
-					}
-					rtu_buf[3 + i/8] |= modbus_get_discrete_input(read_addr + i) << (i & 7);
-				}
+				modbus_read_discrete_inputs(read_addr, read_qty, rtu_buf + 3);
 				resp_len = rtu_buf[2] + 1;
 			}
 			break;
@@ -401,15 +661,11 @@ static void modbus_parse_frame(void)
 			read_qty = (rtu_buf[4] << 8) | rtu_buf[5];
 			if (read_addr >= CFG_MODBUS_INPUT_REGS) {
 				exception = MODBUS_EX_INVALID_ADDRESS;
-			} else if (!read_qty || read_addr + read_qty > CFG_MODBUS_INPUT_REGS) {
+			} else if (!read_qty || read_qty > MODBUS_MAX_READ_REGS || read_addr + read_qty > CFG_MODBUS_INPUT_REGS) {
 				exception = MODBUS_EX_INVALID_DATA;
 			} else {
 				rtu_buf[2] = read_qty*2;
-				for (i = 0; i < read_qty; i++) {
-					val = modbus_get_input_reg(read_addr + i);
-					rtu_buf[3 + i*2] = val >> 8;
-					rtu_buf[4 + i*2] = val & 0xff;
-				}
+				modbus_read_input_regs(read_addr, read_qty, rtu_buf + 3);
 				resp_len = read_qty*2 + 1;
 			}
 			break;
@@ -418,15 +674,11 @@ static void modbus_parse_frame(void)
 			read_qty = (rtu_buf[4] << 8) | rtu_buf[5];
 			if (read_addr >= CFG_MODBUS_HOLDING_REGS) {
 				exception = MODBUS_EX_INVALID_ADDRESS;
-			} else if (!read_qty || read_addr + read_qty > CFG_MODBUS_HOLDING_REGS) {
+			} else if (!read_qty || read_qty > MODBUS_MAX_READ_REGS || read_addr + read_qty > CFG_MODBUS_HOLDING_REGS) {
 				exception = MODBUS_EX_INVALID_DATA;
 			} else {
 				rtu_buf[2] = read_qty*2;
-				for (i = 0; i < read_qty; i++) {
-					val = modbus_get_holding_reg(read_addr + i);
-					rtu_buf[3 + i*2] = val >> 8;
-					rtu_buf[4 + i*2] = val & 0xff;
-				}
+				modbus_read_holding_regs(read_addr, read_qty, rtu_buf + 3);
 				resp_len = read_qty*2 + 1;
 			}
 			break;
@@ -457,10 +709,7 @@ static void modbus_parse_frame(void)
 			} else if (!write_qty || write_addr + write_qty > CFG_MODBUS_HOLDING_REGS || rtu_buf[6] != 2*write_qty) {
 				exception = MODBUS_EX_INVALID_DATA;
 			} else {
-				for (i = 0; i < write_qty; i++) {
-					val = (rtu_buf[7 + i*2] << 8) | rtu_buf[8 + i*2];
-					modbus_set_holding_reg(write_addr + i, val);
-				}
+				modbus_write_holding_regs(write_addr, write_qty, rtu_buf + 7);
 				resp_len = 4;
 			}
 			break;
@@ -471,20 +720,13 @@ static void modbus_parse_frame(void)
 			write_qty = (rtu_buf[8] << 8) | rtu_buf[9];
 			if (read_addr >= CFG_MODBUS_HOLDING_REGS || write_addr >= CFG_MODBUS_HOLDING_REGS) {
 				exception = MODBUS_EX_INVALID_ADDRESS;
-			} else if (!read_qty || read_addr + read_qty > CFG_MODBUS_HOLDING_REGS
+			} else if (!read_qty || read_qty > MODBUS_MAX_READ_REGS || read_addr + read_qty > CFG_MODBUS_HOLDING_REGS
 					|| rtu_buf[10] != 2*write_qty || !write_qty || write_addr + write_qty > CFG_MODBUS_HOLDING_REGS) {
 				exception = MODBUS_EX_INVALID_DATA;
 			} else {
-				for (i = 0; i < write_qty; i++) {
-					val = (rtu_buf[11 + i*2] << 8) | rtu_buf[12 + i*2];
-					modbus_set_holding_reg(write_addr + i, val);
-				}
+				modbus_write_holding_regs(write_addr, write_qty, rtu_buf + 11);
 				rtu_buf[2] = read_qty*2;
-				for (i = 0; i < read_qty; i++) {
-					val = modbus_get_holding_reg(read_addr + i);
-					rtu_buf[3 + i*2] = val >> 8;
-					rtu_buf[4 + i*2] = val & 0xff;
-				}
+				modbus_read_holding_regs(read_addr, read_qty, rtu_buf + 3);
 				resp_len = read_qty*2 + 1;
 			}
 			break;
@@ -505,27 +747,46 @@ static void modbus_parse_frame(void)
 			exception = MODBUS_EX_INVALID_FUNCTION;
 			break;
 	}
+	if (!rtu_buf[0]) {
+		/* Broadcast: executed, but never answered (not even with an exception) */
+		return;
+	}
 	if (exception) {
 		rtu_buf[1] |= 0x80;
 		rtu_buf[2] = exception;
 		resp_len = 1;
 	}
-	modbus_send_response(resp_len);
+	modbus_send_response(rtu_buf, resp_len);
 }
 
 void modbus_receive(uint8_t ch)
 {
+	struct modbus_frame *frame = &rx_frames[rx_head];
+	
 	/*
-	 * A new character has been received: store it in the buffer
-	 * (if the last frame has been processed) and re-start the
-	 * idle timer.
+	 * A new character has been received: store it in the slot being
+	 * filled, update the running CRC and re-start the idle timer.
 	 */
-	if (rtu_ptr < sizeof(rtu_buf) && !frame_len) {
-		rtu_buf[rtu_ptr++] = ch;
+	if (rtu_ptr < sizeof(frame->buf)) {
+		if (!rtu_ptr) {
+			rtu_crc = MODBUS_CRC16_INIT;
+		}
+		frame->buf[rtu_ptr++] = ch;
+		rtu_crc = modbus_crc16_byte(rtu_crc, ch);
+	} else {
+		/* Overrun: the frame will be dropped when it is closed */
+		rtu_ptr = sizeof(frame->buf) + 1;
 	}
 	tc_start_counter(&tc_instance);
 }
 
+void modbus_get_stats(struct modbus_stats *pstats)
+{
+	system_interrupt_enter_critical_section();
+	*pstats = stats;
+	system_interrupt_leave_critical_section();
+}
+
 uint8_t modbus_watchdog (void)
 {
 	return modbus_watchdog_triggered;
@@ -534,6 +795,7 @@ uint8_t modbus_watchdog (void)
 static void update_operating_hours(void)
 {
 	uint8_t tmp[4];
+	uint16_t hours[2];
 	
 	if (get_jiffies() - last_1_minute >= 60000) {
 		last_1_minute = get_jiffies();
@@ -543,27 +805,34 @@ static void update_operating_hours(void)
 		tmp[2] = (operating_minutes >> 8) & 0xFF;
 		tmp[3] = operating_minutes & 0xFF;
 		
-		/*
-		 * Write the updated operating minutes to the EEPROM:
-		 * note that the EEPROM page will NOT be committed right away, but only
-		 * during a power-down or reset.
-		 */
-		eeprom_write(tmp, CFG_EEPROM_HOLDING_OFFSET + 5*EEPROM_PAGE_SIZE - 4, 4);
-		/* Update input registers */
-		modbus_set_input_reg(INPUT_REG__OPERATING_HOURS_3_2, ((operating_minutes/60) >> 16) & 0xFFFF);
-		modbus_set_input_reg(INPUT_REG__OPERATING_HOURS_1_0, (operating_minutes/60) & 0xFFFF);
+		if (journal_valid()) {
+			/* Append to the journal: durable right away */
+			journal_set(JOURNAL_OPERATING_MINUTES, operating_minutes);
+		} else {
+			/*
+			 * No SPI Flash: write the updated operating minutes to the EEPROM.
+			 * Note that the EEPROM page will NOT be committed right away, but only
+			 * during a power-down or reset.
+			 */
+			eeprom_write(tmp, CFG_EEPROM_HOLDING_OFFSET + 5*EEPROM_PAGE_SIZE - 4, 4);
+		}
+		/* Update input registers (both halves at once) */
+		hours[0] = ((operating_minutes/60) >> 16) & 0xFFFF;
+		hours[1] = (operating_minutes/60) & 0xFFFF;
+		modbus_set_input_regs(INPUT_REG__OPERATING_HOURS_3_2, hours, 2);
 	}
 }
 
 /* MODBUS processing (main loop callback) */
 void do_modbus(void)
 {
-	uint8_t len;
-	int new_baud_rate, new_slave_address; 
+	int new_slave_address; 
 
+	journal_poll();
 	update_operating_hours();
 	
-	new_slave_address = env_get("modbus_slave_addr") + (!ioport_get_pin_level(CFG_MODBUS_ADDRESS_4)<<3) + (!ioport_get_pin_level(CFG_MODBUS_ADDRESS_3)<<2) + (!ioport_get_pin_level(CFG_MODBUS_ADDRESS_2)<<1) + !ioport_get_pin_level(CFG_MODBUS_ADDRESS_1);
+	/* The address switches can change at any time; the environment part is set by modbus_env_apply() */
+	new_slave_address = modbus_slave_address();
 	if (new_slave_address != slave_address) {
 		PRINTF("MODBUS slave address: %d\r\n", new_slave_address);
 		slave_address = new_slave_address;
@@ -574,27 +843,23 @@ void do_modbus(void)
 		modbus_watchdog_triggered = 1;
 	}
 	
-	new_baud_rate = env_get("modbus_baud_rate");
-	if (new_baud_rate != baud_rate) {
-		PRINTF("MODBUS: changing baud rate to %d\r\n", new_baud_rate);
-		baud_rate = new_baud_rate;
-		uart_set_baud_rate(CFG_MODBUS_CHANNEL, baud_rate);
-		modbus_configure_timeout();
-	}
-	
-	system_interrupt_enter_critical_section();
-	len = frame_len;
-	system_interrupt_leave_critical_section();
-	
-	if (len) {
-		modbus_parse_frame();
-		system_interrupt_enter_critical_section();
-		/* Allow further input */
-		frame_len = 0;
-		system_interrupt_leave_critical_section();
+	/*
+	 * Parse the queued frames; the ISR keeps receiving into the next slot meanwhile.
+	 * A response may only start once the previous one has left the line and the
+	 * inter-frame gap has passed: otherwise the frame stays queued for a later pass.
+	 */
+	while (rx_tail != rx_head) {
+		if (!rs485_idle_for(frame_gap_us)) {
+			sched_wake(SCHED_MODBUS);
+			break;
+		}
+		modbus_parse_frame(&rx_frames[rx_tail]);
+		/* Release the slot */
+		rx_tail = (rx_tail + 1) % CFG_MODBUS_RX_SLOTS;
 	}
+	modbus_save_holding_regs_policy();
 	
-	if(env_get("disable_update_ability") == 0)
+	if(!update_disabled)
 	{	
 		if (modbus_get_holding_reg(HOLD_REG__UPGRADE_FUNCTION) == MODBUS_UPGRADE_FUNCTION_PREPARE) {
 			PRINTF("MODBUS: starting upgrade\r\n");
@@ -625,7 +890,9 @@ void do_modbus(void)
 				modbus_set_input_reg(INPUT_REG__UPGRADE_STATUS, MODBUS_UPGRADE_STATUS_ERROR);
 			}
 		}
-		modbus_set_holding_reg(HOLD_REG__UPGRADE_FUNCTION, 0);
+		if (modbus_get_holding_reg(HOLD_REG__UPGRADE_FUNCTION)) {
+			modbus_set_holding_reg(HOLD_REG__UPGRADE_FUNCTION, 0);
+		}
 	}
 }
 
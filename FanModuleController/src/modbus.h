@@ -9,6 +9,8 @@
 #ifndef MODBUS_H_
 #define MODBUS_H_
 
+#include "env.h"
+
 #define DIS_INPUT__UNIT_GENERAL_ALARM_STATUS		0x00
 #define DIS_INPUT__TEMP_SENSOR_BROKEN				0x64
 #define DIS_INPUT__HUMIDITY_SENSOR_BROKEN			0x65
@@ -55,6 +57,10 @@
 #define INPUT_REG__OPERATING_HOURS_3_2				0x20
 #define INPUT_REG__OPERATING_HOURS_1_0				0x21
 #define INPUT_REG__RPM_DEVIATION_1_0				0x22
+#define INPUT_REG__POWER_SENSOR_3_2					0x23	/* mW */
+#define INPUT_REG__POWER_SENSOR_1_0					0x24
+#define INPUT_REG__FAN_BLOCK						0x25	/* Fans 1..6: FAN_INPUT_REGS each (FAN_INPUT_xxx) */
+#define INPUT_REG__FAN_BLOCK_END					0x36
 #define INPUT_REG__MANUFACTURER_5_4					0x37
 #define INPUT_REG__MANUFACTURER_3_2					0x38
 #define INPUT_REG__MANUFACTURER_1_0					0x39
@@ -64,6 +70,8 @@
 #define INPUT_REG__DEVICE_NAME_3_2					0x3D
 #define INPUT_REG__DEVICE_NAME_1_0					0x3E
 #define INPUT_REG__UPGRADE_STATUS					0x3F
+#define INPUT_REG__PROFILE_LOOP_RATE				0x40
+#define INPUT_REG__PROFILE_TASKS					0x41	/* last/min/avg/max us per profiled task (4 registers each) */
 
 #define HOLD_REG__UNIT_OFF_ON						0x00
 #define HOLD_REG__PRECONFIG_FAN_REQUEST				0x01
@@ -75,11 +83,45 @@
 #define HOLD_REG__PWM_FREQUENCY						0x07
 #define HOLD_REG__PWM_DELAY							0x08
 #define HOLD_REG__PULSES_PER_REVOLUTION				0x09
-#define HOLD_REG__FAN_CURVE_PWM_0					0x0a
+#define HOLD_REG__FAN_CURVES						0x0a	/* Fan curves (curve.h) */
+#define HOLD_REG__FAN_CURVES_END					0x6E
 #define HOLD_REG__MODBUS_DEAD_TIME					0x6F
 #define HOLD_REG__SOFTWARE_RESET					0x70
+#define HOLD_REG__FAN_CONTROL_MODE					0x71	/* FAN_CONTROL_MODE_xxx */
+#define HOLD_REG__FAN_RPM_REQUEST					0x72	/* Closed-loop speed setpoint (RPM) */
+#define HOLD_REG__FAN_PID_KP						0x73	/* Proportional gain, %PWM per RPM (Q16) */
+#define HOLD_REG__FAN_PID_KI						0x74	/* Integral gain, %PWM per RPM*s (Q16) */
+#define HOLD_REG__FAN_PID_KD						0x75	/* Derivative gain, %PWM per RPM/s (Q16) */
+#define HOLD_REG__INA226_AVERAGING					0x76	/* Samples averaged by the INA226 (1..1024, 0: default) */
+#define HOLD_REG__INA226_CONVERSION_TIME			0x77	/* INA226 conversion time per channel (us, 140..8244, 0: default) */
+#define HOLD_REG__FAN_CURVE_SELECT					0x78	/* Fan curve (fan type) of fan 0 */
+#define HOLD_REG__FAN_BLOCK							0x79	/* Fans 1..6: FAN_HOLD_REGS each (FAN_HOLD_xxx) */
+#define HOLD_REG__FAN_BLOCK_END						0x8A
 #define HOLD_REG__UPGRADE_FUNCTION					0x8F
 
+#define FAN_CONTROL_MODE_PWM						0		/* Open loop: FAN_REQUEST is the PWM */
+#define FAN_CONTROL_MODE_RPM						1		/* Closed loop: FAN_RPM_REQUEST is the speed */
+
+/* Per-fan registers of fans 1.. (fan 0: HOLD_REG__FAN_REQUEST etc.) */
+#define FAN_HOLD_REQUEST							0		/* As HOLD_REG__FAN_REQUEST */
+#define FAN_HOLD_RPM_REQUEST						1		/* As HOLD_REG__FAN_RPM_REQUEST */
+#define FAN_HOLD_CURVE_SELECT						2		/* As HOLD_REG__FAN_CURVE_SELECT */
+#define FAN_HOLD_REGS								3
+#define FAN_INPUT_PWM								0		/* As INPUT_REG__FAN_CURRENT_PWM */
+#define FAN_INPUT_SPEED								1		/* As INPUT_REG__FAN_CURRENT_SPEED */
+#define FAN_INPUT_DEVIATION							2		/* As INPUT_REG__RPM_DEVIATION_1_0 */
+#define FAN_INPUT_REGS								3
+#define HOLD_REG__FAN_N(_fan, _reg)					(HOLD_REG__FAN_BLOCK + ((_fan) - 1)*FAN_HOLD_REGS + (_reg))
+#define INPUT_REG__FAN_N(_fan, _reg)				(INPUT_REG__FAN_BLOCK + ((_fan) - 1)*FAN_INPUT_REGS + (_reg))
+
+/* Receive path and persistence counters */
+struct modbus_stats {
+	uint32_t frames;		/* Frames queued for parsing */
+	uint32_t crc_errors;	/* Frames discarded because of a bad CRC */
+	uint32_t overruns;		/* Frames longer than the receive buffer */
+	uint32_t dropped;		/* Frames lost because all receive slots were full */
+	uint32_t saved_pages;	/* Holding register EEPROM pages written */
+};
 
 int modbus_init(void);
 void modbus_pin_init(void);
@@ -88,9 +130,18 @@ uint8_t modbus_get_discrete_input(uint16_t nr);
 void modbus_set_discrete_input(uint16_t nr, uint8_t val);
 uint16_t modbus_get_input_reg(uint16_t nr);
 void modbus_set_input_reg(uint16_t nr, uint16_t val);
+void modbus_set_input_regs(uint16_t nr, const uint16_t *val, uint16_t qty);
 uint16_t modbus_get_holding_reg(uint16_t nr);
 void modbus_set_holding_reg(uint16_t nr, uint16_t val);
+void modbus_write_holding_regs(uint16_t nr, uint16_t qty, const uint8_t *buf);
+void modbus_read_discrete_inputs(uint16_t nr, uint16_t qty, uint8_t *buf);
+void modbus_read_input_regs(uint16_t nr, uint16_t qty, uint8_t *buf);
+void modbus_read_holding_regs(uint16_t nr, uint16_t qty, uint8_t *buf);
+uint16_t modbus_get_holding_seq(void);
+void modbus_save_holding_regs(void);
+void modbus_get_stats(struct modbus_stats *pstats);
 uint8_t modbus_watchdog (void);
+void modbus_env_apply(enum env_idx idx, uint32_t val);
 void do_modbus(void);
 
 #endif /* MODBUS_H_ */
\ No newline at end of file
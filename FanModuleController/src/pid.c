@@ -0,0 +1,85 @@
+/*
+ * pid.c: fixed-point PID controller
+ *
+ * Created: 10/16/2026 3:12:09 PM
+ *  Author: E1210640
+ */ 
+
+#include <asf.h>
+
+#include "pid.h"
+
+#ifndef BOOTLOADER
+
+static int32_t pid_clamp(int64_t val, int32_t min, int32_t max)
+{
+	if (val < min) {
+		return min;
+	}
+	if (val > max) {
+		return max;
+	}
+	
+	return (int32_t)val;
+}
+
+void pid_init(struct pid *pid, int32_t kp, int32_t ki, int32_t kd, int32_t out_min, int32_t out_max)
+{
+	pid->out_min = out_min;
+	pid->out_max = out_max;
+	pid->integral = 0;
+	pid->last_input = 0;
+	pid_set_gains(pid, kp, ki, kd);
+}
+
+void pid_set_gains(struct pid *pid, int32_t kp, int32_t ki, int32_t kd)
+{
+	pid->kp = kp;
+	pid->ki = ki;
+	pid->kd = kd;
+}
+
+/* Preset the integral so that the next update continues from output (bumpless transfer) */
+void pid_reset(struct pid *pid, int32_t setpoint, int32_t input, int32_t feed_forward, int32_t output)
+{
+	int64_t span = (int64_t)pid->out_max - pid->out_min;
+	
+	pid->last_input = input;
+	pid->integral = pid_clamp((int64_t)output - feed_forward - (int64_t)pid->kp * (setpoint - input), -span, span);
+}
+
+int32_t pid_update(struct pid *pid, int32_t setpoint, int32_t input, int32_t feed_forward, uint16_t dt_ms)
+{
+	int64_t span = (int64_t)pid->out_max - pid->out_min;
+	int32_t error = setpoint - input;
+	int64_t p, d, integral, out;
+	
+	if (!dt_ms) {
+		dt_ms = 1;
+	}
+	p = (int64_t)pid->kp * error;
+	/* Derivative on the measurement: no kick when the setpoint changes */
+	d = -(int64_t)pid->kd * (input - pid->last_input) * 1000 / dt_ms;
+	integral = pid->integral + (int64_t)pid->ki * error * dt_ms / 1000;
+	pid->last_input = input;
+	
+	out = feed_forward + p + integral + d;
+	
+	/* Anti-windup: stop integrating while the output saturates in the direction of the error */
+	if (out > pid->out_max) {
+		out = pid->out_max;
+		if (error > 0) {
+			integral = pid->integral;
+		}
+	} else if (out < pid->out_min) {
+		out = pid->out_min;
+		if (error < 0) {
+			integral = pid->integral;
+		}
+	}
+	pid->integral = pid_clamp(integral, -span, span);
+	
+	return (int32_t)out;
+}
+
+#endif /* BOOTLOADER */
\ No newline at end of file
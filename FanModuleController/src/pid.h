@@ -0,0 +1,34 @@
+/*
+ * pid.h
+ *
+ * Created: 10/16/2026 3:12:26 PM
+ *  Author: E1210640
+ */ 
+
+
+#ifndef PID_H_
+#define PID_H_
+
+#define PID_Q16(_x)		((int32_t)((_x) * 65536))
+
+/*
+ * Fixed-point PID controller. Outputs, output limits and the feed-forward
+ * term are Q16 values; the gains are Q16 output units per input unit
+ * (kp), per input unit and second (ki) and per input unit/second (kd).
+ */
+struct pid {
+	int32_t kp;
+	int32_t ki;
+	int32_t kd;
+	int32_t out_min;
+	int32_t out_max;
+	int32_t integral;
+	int32_t last_input;
+};
+
+void pid_init(struct pid *pid, int32_t kp, int32_t ki, int32_t kd, int32_t out_min, int32_t out_max);
+void pid_set_gains(struct pid *pid, int32_t kp, int32_t ki, int32_t kd);
+void pid_reset(struct pid *pid, int32_t setpoint, int32_t input, int32_t feed_forward, int32_t output);
+int32_t pid_update(struct pid *pid, int32_t setpoint, int32_t input, int32_t feed_forward, uint16_t dt_ms);
+
+#endif /* PID_H_ */
\ No newline at end of file
@@ -0,0 +1,128 @@
+/*
+ * profile.c: main loop profiler
+ *
+ * Created: 10/16/2026 11:02:37 AM
+ *  Author: E1210640
+ */ 
+
+#include <asf.h>
+
+#include "config.h"
+#include "sys_timer.h"
+#include "sched.h"
+#include "modbus.h"
+#include "uart.h"
+#include "profile.h"
+
+#if !defined(BOOTLOADER) && defined(CFG_PROFILE_ENABLE)
+
+#define PROFILE_AVG_SHIFT	4		/* Moving average weight: 1/16 */
+
+/* The task count is an enum: checked with a negative array size instead of #if */
+typedef char profile_regs_fit[INPUT_REG__PROFILE_TASKS + 4*PROFILE_TASK_COUNT <= CFG_MODBUS_INPUT_REGS ? 1 : -1];
+
+static struct {
+	uint32_t calls;
+	uint32_t last;
+	uint32_t min;
+	uint32_t avg_scaled;			/* Average << PROFILE_AVG_SHIFT */
+	uint32_t max;
+} profile_data[PROFILE_TASK_COUNT];
+
+static struct {
+	const char *phase;
+	uint32_t end_us;
+} profile_boot_data[CFG_PROFILE_BOOT_PHASES];
+static uint8_t profile_boot_count;
+
+void profile_end(int task, uint32_t start)
+{
+	uint32_t elapsed = get_micros() - start;
+	
+	if (!profile_data[task].calls++) {
+		profile_data[task].min = elapsed;
+		profile_data[task].avg_scaled = elapsed << PROFILE_AVG_SHIFT;
+	}
+	profile_data[task].last = elapsed;
+	if (elapsed < profile_data[task].min) {
+		profile_data[task].min = elapsed;
+	}
+	if (elapsed > profile_data[task].max) {
+		profile_data[task].max = elapsed;
+	}
+	profile_data[task].avg_scaled += elapsed - (profile_data[task].avg_scaled >> PROFILE_AVG_SHIFT);
+}
+
+void profile_reset(void)
+{
+	memset(profile_data, 0, sizeof(profile_data));
+}
+
+const char *profile_get_name(int task)
+{
+	return task == PROFILE_LOOP ? "loop" : sched_get_name(task);
+}
+
+void profile_get_stats(int task, struct profile_stats *stats)
+{
+	stats->calls = profile_data[task].calls;
+	stats->last_us = profile_data[task].last;
+	stats->min_us = profile_data[task].min;
+	stats->avg_us = profile_data[task].avg_scaled >> PROFILE_AVG_SHIFT;
+	stats->max_us = profile_data[task].max;
+}
+
+/* Boot phases: only the first CFG_PROFILE_BOOT_PHASES are kept */
+void profile_boot(const char *phase)
+{
+	if (profile_boot_count < CFG_PROFILE_BOOT_PHASES) {
+		profile_boot_data[profile_boot_count].phase = phase;
+		profile_boot_data[profile_boot_count].end_us = get_micros();
+		profile_boot_count++;
+	}
+}
+
+void profile_boot_print(void)
+{
+	uint32_t start_us = 0;
+	int i;
+	
+	PRINTF("%-22s %10s %10s\r\n", "boot phase", "end", "duration");
+	for (i = 0; i < profile_boot_count; i++) {
+		PRINTF("%-22s %10lu %10lu\r\n", profile_boot_data[i].phase, profile_boot_data[i].end_us,
+			profile_boot_data[i].end_us - start_us);
+		start_us = profile_boot_data[i].end_us;
+	}
+	PRINTF("(times in us since the system timer was started)\r\n");
+}
+
+static uint16_t profile_saturate(uint32_t us)
+{
+	return us > 0xFFFF ? 0xFFFF : us;
+}
+
+/* Publish the statistics in the MODBUS input registers */
+static void profile_sync_to_modbus(void)
+{
+	struct profile_stats stats;
+	uint16_t regs[4];
+	int i;
+	
+	modbus_set_input_reg(INPUT_REG__PROFILE_LOOP_RATE, profile_saturate(sched_get_loop_rate()));
+	for (i = 0; i < PROFILE_TASK_COUNT; i++) {
+		profile_get_stats(i, &stats);
+		regs[0] = profile_saturate(stats.last_us);
+		regs[1] = profile_saturate(stats.min_us);
+		regs[2] = profile_saturate(stats.avg_us);
+		regs[3] = profile_saturate(stats.max_us);
+		modbus_set_input_regs(INPUT_REG__PROFILE_TASKS + i*4, regs, 4);
+	}
+}
+
+/* Periodic task: publish the statistics */
+void do_profile(void)
+{
+	profile_sync_to_modbus();
+}
+
+#endif /* !BOOTLOADER && CFG_PROFILE_ENABLE */
\ No newline at end of file
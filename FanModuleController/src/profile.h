@@ -0,0 +1,61 @@
+/*
+ * profile.h
+ *
+ * Created: 10/16/2026 11:02:51 AM
+ *  Author: E1210640
+ */ 
+
+
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include "config.h"
+#include "sys_timer.h"
+#include "sched.h"
+
+/* Profiled items: the scheduler tasks, followed by a whole scheduler pass */
+enum profile_task {
+	PROFILE_LOOP = SCHED_TASK_COUNT,
+	PROFILE_TASK_COUNT
+};
+
+/* Execution times in us */
+struct profile_stats {
+	uint32_t calls;
+	uint32_t last_us;
+	uint32_t min_us;
+	uint32_t avg_us;		/* Moving average over the last ~16 calls */
+	uint32_t max_us;
+};
+
+#ifdef CFG_PROFILE_ENABLE
+
+/* Run a task call and account its execution time */
+#define PROFILE(_task, _call) \
+	do { \
+		uint32_t _start = get_micros(); \
+		_call; \
+		profile_end(_task, _start); \
+	} while (0)
+
+void profile_end(int task, uint32_t start);
+void do_profile(void);
+void profile_reset(void);
+const char *profile_get_name(int task);
+void profile_get_stats(int task, struct profile_stats *stats);
+
+/* Record the end of a boot phase (time since the system timer was started) */
+#define PROFILE_BOOT(_phase)	profile_boot(_phase)
+
+void profile_boot(const char *phase);
+void profile_boot_print(void);
+
+#else
+
+#define PROFILE(_task, _call)	_call
+#define do_profile()			do {} while (0)
+#define PROFILE_BOOT(_phase)	do {} while (0)
+
+#endif /* CFG_PROFILE_ENABLE */
+
+#endif /* PROFILE_H_ */
\ No newline at end of file
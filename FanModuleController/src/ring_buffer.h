@@ -30,13 +30,25 @@ static inline int ring_size(void *ptr)
 	return ring->head < ring->tail ? ring->size - ring->tail + ring->head : ring->head - ring->tail;
 }
 
+static inline int ring_space(void *ptr)
+{
+	struct ring_buffer *ring = (struct ring_buffer *)ptr;
+	
+	return ring->size - 1 - ring_size(ring);
+}
+
+/*
+ * The head index is only updated once the data is in place, so a single producer
+ * and a single consumer (e.g. main loop and ISR) can share a ring without locking.
+ */
 static inline void ring_put(void *ptr, uint8_t data)
 {
 	struct ring_buffer *ring = (struct ring_buffer *)ptr;
+	int head = (ring->head + 1) % ring->size;
 	
-	if ((ring->head + 1) % ring->size != ring->tail) {
-		ring->data[ring->head++] = data;
-		ring->head %= ring->size;
+	if (head != ring->tail) {
+		ring->data[ring->head] = data;
+		ring->head = head;
 	}
 }
 
@@ -0,0 +1,148 @@
+/*
+ * rs485.c: RS-485 transceiver (driver enable/receiver enable) control
+ *
+ * Created: 10/16/2026 9:10:05 AM
+ *  Author: E1210640
+ */ 
+
+#include <asf.h>
+
+#include "config.h"
+#include "uart.h"
+#include "sys_timer.h"
+#include "rs485.h"
+
+#ifndef BOOTLOADER
+
+/*
+ * The driver is enabled right before a transmission is queued and released from
+ * the UART transmit-complete (TXC) interrupt, i.e. as soon as the last stop bit
+ * has left the shift register, or CFG_RS485_GUARD_TIME_US later from the
+ * compare interrupt of CFG_RS485_GUARD_TC_MODULE.
+ */
+
+#if CFG_RS485_GUARD_TIME_US > 0
+#if CFG_RS485_GUARD_TIME_US * 8 > 0xFFFF
+#error "CFG_RS485_GUARD_TIME_US does not fit in the 16-bit guard timer"
+#endif
+static struct tc_module guard_tc;
+#endif
+static volatile uint8_t tx_active;
+static volatile uint8_t tx_gap_pending;			/* The inter-frame gap after the last response is running */
+static volatile uint32_t tx_done_us;			/* TXC of the last response */
+static uint32_t rx_done_us;
+static struct rs485_stats stats;
+
+static void rs485_release(void)
+{
+	/* Disable the driver and enable the receiver */
+	ioport_set_pin_level(CFG_MODBUS_DE_PIN, IOPORT_PIN_LEVEL_LOW);
+	ioport_set_pin_level(CFG_MODBUS_RE_PIN, IOPORT_PIN_LEVEL_LOW);
+}
+
+/* End of a response: release the line (interrupt context) */
+static void rs485_tx_end(void)
+{
+	rs485_release();
+	tx_active = 0;
+	stats.turnaround_us = get_micros() - tx_done_us;
+	if (stats.turnaround_us > stats.turnaround_max_us) {
+		stats.turnaround_max_us = stats.turnaround_us;
+	}
+}
+
+#if CFG_RS485_GUARD_TIME_US > 0
+/* Guard time elapsed (interrupt context) */
+static void rs485_guard_callback(struct tc_module *const module_inst)
+{
+	tc_stop_counter(&guard_tc);
+	rs485_tx_end();
+}
+#endif
+
+/* Transmit-complete callback (interrupt context) */
+static void rs485_tx_complete(int chan)
+{
+	tx_done_us = get_micros();
+	tx_gap_pending = 1;
+#if CFG_RS485_GUARD_TIME_US > 0
+	/* The driver is released from the compare interrupt */
+	tc_start_counter(&guard_tc);
+#else
+	rs485_tx_end();
+#endif
+}
+
+void rs485_init(void)
+{
+#if CFG_RS485_GUARD_TIME_US > 0
+	struct tc_config config;
+	tc_get_config_defaults(&config);
+	config.counter_size = TC_COUNTER_SIZE_16BIT;
+	config.clock_source = GCLK_GENERATOR_0;				/* 8 MHz */
+	config.clock_prescaler = TC_CLOCK_PRESCALER_DIV1;
+	config.counter_16_bit.compare_capture_channel[0] = 8*CFG_RS485_GUARD_TIME_US;
+	
+	tc_init(&guard_tc, CFG_RS485_GUARD_TC_MODULE, &config);
+	tc_enable(&guard_tc);
+	/* Started from the TXC interrupt only */
+	tc_stop_counter(&guard_tc);
+	tc_register_callback(&guard_tc, rs485_guard_callback, TC_CALLBACK_CC_CHANNEL0);
+	tc_enable_callback(&guard_tc, TC_CALLBACK_CC_CHANNEL0);
+#endif
+	uart_set_tx_complete_callback(CFG_MODBUS_CHANNEL, rs485_tx_complete);
+	rs485_release();
+}
+
+/* Called when a complete request has been received (reference for the response latency) */
+void rs485_rx_done(void)
+{
+	rx_done_us = get_micros();
+}
+
+void rs485_send(const uint8_t *buf, int len)
+{
+	/* Enable the driver and disable the receiver */
+	ioport_set_pin_level(CFG_MODBUS_DE_PIN, IOPORT_PIN_LEVEL_HIGH);
+	ioport_set_pin_level(CFG_MODBUS_RE_PIN, IOPORT_PIN_LEVEL_HIGH);
+	tx_active = 1;
+	
+	stats.frames++;
+	stats.response_us = get_micros() - rx_done_us;
+	if (stats.response_us > stats.response_max_us) {
+		stats.response_max_us = stats.response_us;
+	}
+	
+	/* Queued: the line is released from the TXC interrupt */
+	uart_write(CFG_MODBUS_CHANNEL, buf, len);
+}
+
+int rs485_busy(void)
+{
+	return tx_active;
+}
+
+/* 1 if no response is being sent and the last one ended at least gap_us ago (main loop only) */
+int rs485_idle_for(uint32_t gap_us)
+{
+	if (tx_active) {
+		return 0;
+	}
+	if (tx_gap_pending) {
+		if (get_micros() - tx_done_us < gap_us) {
+			return 0;
+		}
+		tx_gap_pending = 0;
+	}
+	
+	return 1;
+}
+
+void rs485_get_stats(struct rs485_stats *pstats)
+{
+	system_interrupt_enter_critical_section();
+	*pstats = stats;
+	system_interrupt_leave_critical_section();
+}
+
+#endif /* BOOTLOADER */
\ No newline at end of file
@@ -0,0 +1,27 @@
+/*
+ * rs485.h
+ *
+ * Created: 10/16/2026 9:12:40 AM
+ *  Author: E1210640
+ */ 
+
+
+#ifndef RS485_H_
+#define RS485_H_
+
+struct rs485_stats {
+	uint32_t frames;				/* Frames transmitted */
+	uint32_t response_us;			/* Last request end -> driver enabled */
+	uint32_t response_max_us;
+	uint32_t turnaround_us;			/* TXC interrupt entry -> driver released (guard time included, interrupt latency not) */
+	uint32_t turnaround_max_us;
+};
+
+void rs485_init(void);
+void rs485_rx_done(void);
+void rs485_send(const uint8_t *buf, int len);
+int rs485_busy(void);
+int rs485_idle_for(uint32_t gap_us);
+void rs485_get_stats(struct rs485_stats *stats);
+
+#endif /* RS485_H_ */
\ No newline at end of file
@@ -0,0 +1,180 @@
+/*
+ * sched.c: cooperative main loop scheduler
+ *
+ * Created: 10/16/2026 1:40:52 PM
+ *  Author: E1210640
+ */ 
+
+#include <asf.h>
+
+#include "config.h"
+#include "sys_timer.h"
+#include "heartbeat.h"
+#include "fan.h"
+#include "i2c_local.h"
+#include "cli.h"
+#include "modbus.h"
+#include "alarm.h"
+#include "led.h"
+#include "env.h"
+#include "watchdog.h"
+#include "profile.h"
+#include "sched.h"
+
+#ifndef BOOTLOADER
+
+#define CFG_SCHED_TASK(_idx, _name, _call, _period) \
+	[_idx] = _name,
+
+static const char *sched_names[] = { CFG_SCHED_TASKS };
+
+#undef CFG_SCHED_TASK
+
+#define CFG_SCHED_TASK(_idx, _name, _call, _period) \
+	[_idx] = _period,
+
+static const uint16_t sched_periods[] = { CFG_SCHED_TASKS };
+
+#undef CFG_SCHED_TASK
+
+static uint32_t sched_next[SCHED_TASK_COUNT];	/* Next deadline (jiffies) of the periodic tasks */
+static volatile uint32_t sched_woken;			/* Tasks woken by sched_wake() (bitmap) */
+
+static uint32_t loop_count;
+static uint32_t loop_rate;
+static uint32_t idle_us;
+static uint32_t idle_percent;
+static uint32_t last_rate;
+
+void sched_init(void)
+{
+	uint32_t now = get_jiffies();
+	int i;
+	
+	/* WFI only stops the CPU clock: peripherals and SysTick keep running */
+	system_set_sleepmode(SYSTEM_SLEEPMODE_IDLE_0);
+	for (i = 0; i < SCHED_TASK_COUNT; i++) {
+		sched_next[i] = now;
+	}
+	last_rate = now;
+}
+
+/* Make a task ready to run on the next scheduler pass (may be called from interrupt context) */
+void sched_wake(enum sched_task task)
+{
+	system_interrupt_enter_critical_section();
+	sched_woken |= (1UL << task);
+	system_interrupt_leave_critical_section();
+}
+
+const char *sched_get_name(enum sched_task task)
+{
+	return sched_names[task];
+}
+
+/* Scheduler passes counted over the last second */
+uint32_t sched_get_loop_rate(void)
+{
+	return loop_rate;
+}
+
+/* Share of the last second spent sleeping */
+uint32_t sched_get_idle_percent(void)
+{
+	return idle_percent;
+}
+
+/* Return the highest-priority (first in CFG_SCHED_TASKS) task that is due, or -1 */
+static int sched_next_task(void)
+{
+	uint32_t now = get_jiffies();
+	int i;
+	
+	for (i = 0; i < SCHED_TASK_COUNT; i++) {
+		if (sched_woken & (1UL << i)) {
+			return i;
+		}
+		if (sched_periods[i] && time_after_eq(now, sched_next[i])) {
+			return i;
+		}
+	}
+	
+	return -1;
+}
+
+static void sched_run_task(int task)
+{
+	uint32_t now = get_jiffies();
+	
+	system_interrupt_enter_critical_section();
+	sched_woken &= ~(1UL << task);
+	system_interrupt_leave_critical_section();
+	if (sched_periods[task] && time_after_eq(now, sched_next[task])) {
+		sched_next[task] += sched_periods[task];
+		if (time_after_eq(now, sched_next[task])) {
+			/* Overrun: do not try to catch up */
+			sched_next[task] = now + sched_periods[task];
+		}
+	}
+	
+#define CFG_SCHED_TASK(_idx, _name, _call, _period) \
+	case _idx: \
+		PROFILE(_idx, _call); \
+		break;
+	
+	switch (task) {
+		CFG_SCHED_TASKS
+		default:
+			break;
+	}
+	
+#undef CFG_SCHED_TASK
+}
+
+/*
+ * Sleep until the next interrupt. Interrupts are masked while checking for
+ * woken tasks, so that a wake-up between the check and WFI is not lost
+ * (a pending interrupt still terminates WFI with PRIMASK set).
+ */
+static void sched_sleep(void)
+{
+	uint32_t start = get_micros();
+	
+	__disable_irq();
+	if (!sched_woken) {
+		__DSB();
+		__WFI();
+	}
+	__enable_irq();
+	idle_us += get_micros() - start;
+}
+
+/* Run every task that is due (highest priority first), then sleep */
+void do_sched(void)
+{
+	uint32_t start = get_micros();
+	int task;
+	
+	while ((task = sched_next_task()) >= 0) {
+		sched_run_task(task);
+		WDT_RESET;
+	}
+#ifdef CFG_PROFILE_ENABLE
+	profile_end(PROFILE_LOOP, start);
+#else
+	(void)start;
+#endif
+	
+	loop_count++;
+	if (get_jiffies() - last_rate >= 1000) {
+		last_rate = get_jiffies();
+		loop_rate = loop_count;
+		idle_percent = idle_us / 10000;
+		loop_count = 0;
+		idle_us = 0;
+	}
+	
+	sched_sleep();
+}
+
+#endif /* BOOTLOADER */
\ No newline at end of file
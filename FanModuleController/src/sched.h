@@ -0,0 +1,32 @@
+/*
+ * sched.h
+ *
+ * Created: 10/16/2026 1:41:08 PM
+ *  Author: E1210640
+ */ 
+
+
+#ifndef SCHED_H_
+#define SCHED_H_
+
+#include "config.h"
+
+/* Task indices, generated from CFG_SCHED_TASKS */
+#define CFG_SCHED_TASK(_idx, _name, _call, _period) \
+	_idx,
+
+enum sched_task {
+	CFG_SCHED_TASKS
+	SCHED_TASK_COUNT
+};
+
+#undef CFG_SCHED_TASK
+
+void sched_init(void);
+void sched_wake(enum sched_task task);
+const char *sched_get_name(enum sched_task task);
+uint32_t sched_get_loop_rate(void);
+uint32_t sched_get_idle_percent(void);
+void do_sched(void);
+
+#endif /* SCHED_H_ */
\ No newline at end of file
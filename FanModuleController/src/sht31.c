@@ -0,0 +1,208 @@
+/*
+ * sht31.c: SHT31 temperature/humidity sensor driver
+ *
+ * Created: 10/16/2026 5:02:58 PM
+ *  Author: E1210640
+ *
+ * Readings: input registers input_reg+0 (temperature, 0.01 degC) and
+ * input_reg+1 (humidity, 0.01 %RH); discrete inputs discrete_input+0/+1
+ * (temperature/humidity sensor broken).
+ *
+ * In periodic mode (CFG_SHT31_MODE), the sensor measures on its own and
+ * each sample is a single Fetch Data transaction returning the latest
+ * result. The rate should be higher than the sample rate: the sensor
+ * NACKs the fetch when no new result is available.
+ */ 
+
+#include <asf.h>
+
+#include "config.h"
+#include "sht31.h"
+#include "modbus.h"
+#include "fixp.h"
+#include "crc.h"
+#include "sys_timer.h"
+
+#ifndef BOOTLOADER
+
+#define SHT31_CMD_FETCH_DATA		0xE000
+#define SHT31_CMD_BREAK				0x3093		/* Stop the periodic mode */
+
+#define SHT31_CRC8_INIT				0xFF
+#define SHT31_CRC8_POLYNOMIAL		0x31
+
+/* Transactions */
+#define SHT31_XFER_READ				0
+#define SHT31_XFER_MEASURE			1
+#define SHT31_XFER_DIAG				2
+
+/* Buffer layout */
+#define SHT31_BUF_DATA				0			/* Temperature, CRC, humidity, CRC */
+#define SHT31_BUF_CMD				6			/* Measurement/periodic mode command */
+#define SHT31_BUF_FETCH				8			/* Fetch Data command */
+#define SHT31_BUF_DIAG_CMD			10
+#define SHT31_BUF_DIAG_DATA			12			/* Status, CRC */
+
+#define SHT31_PERIODIC				(CFG_SHT31_MODE != SHT31_MODE_SINGLE_SHOT)
+
+static uint32_t sht31_crc_errors;
+
+/* Check the CRC of a 16-bit word of sensor data */
+static int sht31_word_ok(const uint8_t *data)
+{
+	if (crc8(SHT31_CRC8_INIT, data, 2, SHT31_CRC8_POLYNOMIAL) != data[2]) {
+		sht31_crc_errors++;
+		return 0;
+	}
+	
+	return 1;
+}
+
+static void sht31_init(struct i2c_sensor *sensor)
+{
+	struct i2c_xfer *xfer;
+	
+	sensor->buf[SHT31_BUF_CMD] = CFG_SHT31_MODE >> 8;
+	sensor->buf[SHT31_BUF_CMD+1] = CFG_SHT31_MODE & 0xFF;
+	sensor->buf[SHT31_BUF_FETCH] = SHT31_CMD_FETCH_DATA >> 8;
+	sensor->buf[SHT31_BUF_FETCH+1] = SHT31_CMD_FETCH_DATA & 0xFF;
+	
+	xfer = &sensor->xfer[SHT31_XFER_READ];
+	if (SHT31_PERIODIC) {
+		xfer->wr_buf = &sensor->buf[SHT31_BUF_FETCH];
+		xfer->wr_len = 2;
+	}
+	xfer->rd_buf = &sensor->buf[SHT31_BUF_DATA];
+	xfer->rd_len = 6;
+	
+	xfer = &sensor->xfer[SHT31_XFER_MEASURE];
+	xfer->wr_buf = &sensor->buf[SHT31_BUF_CMD];
+	xfer->wr_len = 2;
+	
+	xfer = &sensor->xfer[SHT31_XFER_DIAG];
+	xfer->wr_buf = &sensor->buf[SHT31_BUF_DIAG_CMD];
+	xfer->wr_len = 2;
+	
+	ioport_set_pin_dir(CFG_RESET_SHT31, IOPORT_DIR_OUTPUT);
+	ioport_set_pin_level(CFG_RESET_SHT31, IOPORT_PIN_LEVEL_LOW);
+	
+	/* Start the first measurement, or the periodic mode */
+	i2c_sensor_submit(sensor, &sensor->xfer[SHT31_XFER_MEASURE]);
+}
+
+/* Fetch the latest result, or read the single shot measurement started after the previous sample */
+static void sht31_sample(struct i2c_sensor *sensor)
+{
+	i2c_sensor_submit(sensor, &sensor->xfer[SHT31_XFER_READ]);
+}
+
+static int sht31_convert(struct i2c_sensor *sensor)
+{
+	uint16_t regs[2] = { 0, 0 };
+	uint8_t *data = &sensor->buf[SHT31_BUF_DATA];
+	uint8_t temp_ok = 0, hum_ok = 0;
+	int ret = -1;
+	
+	if (sensor->xfer[SHT31_XFER_READ].status == I2C_XFER_DONE) {
+		/* A CRC error only invalidates that reading */
+		temp_ok = sht31_word_ok(&data[0]);
+		hum_ok = sht31_word_ok(&data[3]);
+		if (temp_ok) {
+			regs[0] = (uint16_t)fixp_convert((data[0]<<8) | data[1], CFG_SHT31_TEMP_NUM, CFG_SHT31_TEMP_DEN, CFG_SHT31_TEMP_OFFSET);
+		}
+		if (hum_ok) {
+			regs[1] = (uint16_t)fixp_convert((data[3]<<8) | data[4], CFG_SHT31_HUM_NUM, CFG_SHT31_HUM_DEN, 0);
+		}
+		if (!SHT31_PERIODIC) {
+			/* Start the next measurement */
+			i2c_sensor_submit(sensor, &sensor->xfer[SHT31_XFER_MEASURE]);
+		}
+		ret = 0;
+	}
+	modbus_set_discrete_input(sensor->discrete_input, !temp_ok);
+	modbus_set_discrete_input(sensor->discrete_input + 1, !hum_ok);
+	modbus_set_input_regs(sensor->input_reg, regs, 2);
+	
+	return ret;
+}
+
+/* Reset pulse, then restart the measurements */
+static uint16_t sht31_recover(struct i2c_sensor *sensor, uint8_t step)
+{
+	switch (step) {
+		case 0:
+			ioport_set_pin_level(CFG_RESET_SHT31, IOPORT_PIN_LEVEL_HIGH);
+			return 1;
+		case 1:
+			ioport_set_pin_level(CFG_RESET_SHT31, IOPORT_PIN_LEVEL_LOW);
+			return 5;
+		default:
+			i2c_sensor_submit(sensor, &sensor->xfer[SHT31_XFER_MEASURE]);
+			return 0;
+	}
+}
+
+static int sht31_command(struct i2c_sensor *sensor, uint16_t cmd, uint8_t rd_len)
+{
+	struct i2c_xfer *xfer = &sensor->xfer[SHT31_XFER_DIAG];
+	
+	sensor->buf[SHT31_BUF_DIAG_CMD] = cmd >> 8;
+	sensor->buf[SHT31_BUF_DIAG_CMD+1] = cmd & 0xFF;
+	xfer->address = sensor->address;
+	xfer->rd_buf = &sensor->buf[SHT31_BUF_DIAG_DATA];
+	xfer->rd_len = rd_len;
+	
+	return i2c_transfer(xfer) == I2C_XFER_DONE ? 0 : -1;
+}
+
+static void sht31_wait_ms(uint32_t ms)
+{
+	uint32_t start = get_jiffies();
+	
+	while (!time_after(get_jiffies(), start + ms));
+}
+
+/*
+ * Diagnostics (CLI, blocks for a few ms): run a command, reading its 16-bit
+ * answer if val is not NULL. The periodic mode is stopped meanwhile.
+ */
+int sht31_diag(struct i2c_sensor *sensor, uint16_t cmd, uint16_t *val)
+{
+	uint8_t *data = &sensor->buf[SHT31_BUF_DIAG_DATA];
+	int ret;
+	
+	if (SHT31_PERIODIC) {
+		sht31_command(sensor, SHT31_CMD_BREAK, 0);
+		sht31_wait_ms(1);
+	}
+	ret = sht31_command(sensor, cmd, val ? 3 : 0);
+	if (ret == 0 && val) {
+		if (sht31_word_ok(data)) {
+			*val = (data[0] << 8) | data[1];
+		} else {
+			ret = -1;
+		}
+	}
+	if (SHT31_PERIODIC) {
+		sht31_wait_ms(1);
+		sht31_command(sensor, CFG_SHT31_MODE, 0);
+		/* Give the sensor a full period to produce a result */
+		sensor->next = get_jiffies() + sensor->period;
+	}
+	
+	return ret;
+}
+
+uint32_t sht31_get_crc_errors(void)
+{
+	return sht31_crc_errors;
+}
+
+const struct i2c_sensor_driver sht31_driver = {
+	.init = sht31_init,
+	.sample = sht31_sample,
+	.convert = sht31_convert,
+	.recover = sht31_recover,
+};
+
+#endif /* BOOTLOADER */
\ No newline at end of file
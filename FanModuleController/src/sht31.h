@@ -0,0 +1,42 @@
+/*
+ * sht31.h
+ *
+ * Created: 10/16/2026 5:02:58 PM
+ *  Author: E1210640
+ */ 
+
+
+#ifndef SHT31_H_
+#define SHT31_H_
+
+#include "i2c_local.h"
+
+/* Measurement modes (CFG_SHT31_MODE), medium repeatability */
+#define SHT31_MODE_SINGLE_SHOT			0x240B		/* One measurement per sample, read on the next one */
+#define SHT31_MODE_PERIODIC_0_5_MPS		0x2024
+#define SHT31_MODE_PERIODIC_1_MPS		0x2126
+#define SHT31_MODE_PERIODIC_2_MPS		0x2220
+#define SHT31_MODE_PERIODIC_4_MPS		0x2322
+#define SHT31_MODE_PERIODIC_10_MPS		0x2721
+
+/* Diagnostic commands (sht31_diag()) */
+#define SHT31_CMD_READ_STATUS			0xF32D
+#define SHT31_CMD_CLEAR_STATUS			0x3041
+#define SHT31_CMD_HEATER_ENABLE			0x306D
+#define SHT31_CMD_HEATER_DISABLE		0x3066
+
+/* Status register */
+#define SHT31_STATUS_ALERT_PENDING		0x8000
+#define SHT31_STATUS_HEATER				0x2000
+#define SHT31_STATUS_RH_ALERT			0x0800
+#define SHT31_STATUS_T_ALERT			0x0400
+#define SHT31_STATUS_RESET				0x0010
+#define SHT31_STATUS_COMMAND_FAILED		0x0002
+#define SHT31_STATUS_CHECKSUM_FAILED	0x0001
+
+extern const struct i2c_sensor_driver sht31_driver;
+
+int sht31_diag(struct i2c_sensor *sensor, uint16_t cmd, uint16_t *val);
+uint32_t sht31_get_crc_errors(void);
+
+#endif /* SHT31_H_ */
\ No newline at end of file
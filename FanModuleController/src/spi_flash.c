@@ -12,11 +12,13 @@
 #include "debug.h"
 #include "watchdog.h"
 #include "uart.h"
+#include "sys_timer.h"
 
 /* SPI Flash commands */
 #define SPI_FLASH_READ_ID_CMD		0x9F
 #define SPI_FLASH_READ_DATA_CMD		0x03
 #define SPI_FLASH_ERASE_BLOCK_CMD	0xD8
+#define SPI_FLASH_ERASE_SECTOR_CMD	0x20
 #define SPI_FLASH_PAGE_PROGRAM_CMD	0x02
 #define SPI_FLASH_READ_STATUS_CMD	0x05
 #define SPI_FLASH_WREN_CMD			0x06
@@ -28,10 +30,11 @@ struct {
 	const char *name;
 	uint32_t id;
 	uint32_t page_size;
+	uint32_t sector_size;
 	uint32_t block_size;
 	uint32_t total_size;
 } spi_flash_table[] = {
-	{ "gd25q80", 0xC84014, 256, 64*1024, 16*64*1024 }
+	{ "gd25q80", 0xC84014, 256, 4*1024, 64*1024, 16*64*1024 }
 };
 
 #define SPI_FLASH_TABLE_SIZE	(int)(sizeof(spi_flash_table)/sizeof(*spi_flash_table))
@@ -72,6 +75,8 @@ int spi_flash_get_status(uint8_t *pstat)
 	return 0;
 }
 
+#ifdef BOOTLOADER
+
 static int spi_flash_wait_ready(void)
 {
 	uint8_t status;
@@ -92,10 +97,39 @@ static int spi_flash_wait_ready(void)
 	return -1;
 }
 
+#else
+
+/* Polled against the system timer: the ASF delay routines re-program SysTick */
+static int spi_flash_wait_ready(void)
+{
+	uint8_t status;
+	uint32_t start = get_jiffies();
+	
+	do {
+		WDT_RESET;
+		if (spi_flash_get_status(&status) < 0) {
+			return -1;
+		}
+		if (!(status & SPI_FLASH_STATUS_BSY)) {
+			return 0;
+		}
+	} while (get_jiffies() - start < 5000);
+	PRINTF("SPI: busy timeout\r\n");
+	
+	return -1;
+}
+
+#endif /* BOOTLOADER */
+
+/* Also waits for a background erase (spi_flash_erase_sector_start()) to finish */
 static int spi_flash_write_enable(void)
 {
 	uint8_t cmd = SPI_FLASH_WREN_CMD;
 	
+	if (spi_flash_wait_ready() < 0) {
+		return -1;
+	}
+	
 	return spi_flash_xfer(&cmd, 1, NULL, 0, 1, 1);
 }
 
@@ -116,22 +150,19 @@ int spi_flash_read(uint32_t addr, uint8_t *buf, int len)
 	cmd[1] = (addr >> 16) & 0xFF;
 	cmd[2] = (addr >> 8) & 0xFF;
 	cmd[3] = addr & 0xFF;
+	if (spi_flash_wait_ready() < 0) {
+		return -1;
+	}
 	
 	return spi_flash_xfer(cmd, sizeof(cmd), buf, len, 1, 1);
 }
 
-int spi_flash_erase(uint32_t addr, int len)
+/* Erase the erase units (cmd, size) covering addr..addr+len-1 */
+static int spi_flash_erase_units(uint8_t erase_cmd, uint32_t size, uint32_t addr, int len)
 {
 	uint32_t last = addr + len - 1;
-	uint8_t cmd[4] = { SPI_FLASH_ERASE_BLOCK_CMD };
+	uint8_t cmd[4] = { erase_cmd };
 	
-	if (spi_flash_type < 0) {
-		return -1;
-	}
-	if (len < 0) {
-		/* Erase the entire Flash */
-		return spi_flash_erase(0, spi_flash_table[spi_flash_type].total_size);
-	}
 	while (addr <= last) {
 		WDT_RESET;
 		if (spi_flash_write_enable() < 0) {
@@ -142,19 +173,74 @@ int spi_flash_erase(uint32_t addr, int len)
 		cmd[2] = (addr >> 8) & 0xFF;
 		cmd[3] = addr & 0xFF;
 		if (spi_flash_xfer(cmd, sizeof(cmd), NULL, 0, 1, 1) < 0) {
-			PRINTF("SPI: block erase failed @ 0x%08lx\r\n", addr);
+			PRINTF("SPI: erase failed @ 0x%08lx\r\n", addr);
 			return -1;
 		}
 		if (spi_flash_wait_ready() < 0) {
 			PRINTF("SPI: wait for ready failed\r\n");
 			return -1;
 		}
-		addr += spi_flash_table[spi_flash_type].block_size;
+		addr += size;
 	}
 	
 	return 0;
 }
 
+int spi_flash_erase(uint32_t addr, int len)
+{
+	if (spi_flash_type < 0) {
+		return -1;
+	}
+	if (len < 0) {
+		/* Erase the entire Flash */
+		return spi_flash_erase(0, spi_flash_table[spi_flash_type].total_size);
+	}
+	
+	return spi_flash_erase_units(SPI_FLASH_ERASE_BLOCK_CMD, spi_flash_table[spi_flash_type].block_size, addr, len);
+}
+
+#ifndef BOOTLOADER
+
+/*
+ * Start erasing the sector at addr and return without waiting (GD25Q80: up
+ * to 300 ms): poll spi_flash_busy(). The other functions wait for the erase.
+ */
+int spi_flash_erase_sector_start(uint32_t addr)
+{
+	uint8_t cmd[4] = { SPI_FLASH_ERASE_SECTOR_CMD };
+	
+	if (spi_flash_type < 0) {
+		return -1;
+	}
+	if (spi_flash_write_enable() < 0) {
+		PRINTF("SPI: write enable failed\r\n");
+		return -1;
+	}
+	cmd[1] = (addr >> 16) & 0xFF;
+	cmd[2] = (addr >> 8) & 0xFF;
+	cmd[3] = addr & 0xFF;
+	if (spi_flash_xfer(cmd, sizeof(cmd), NULL, 0, 1, 1) < 0) {
+		PRINTF("SPI: erase failed @ 0x%08lx\r\n", addr);
+		return -1;
+	}
+	
+	return 0;
+}
+
+/* 1 while an erase or program is in progress, 0 when ready, -1 on error */
+int spi_flash_busy(void)
+{
+	uint8_t status;
+	
+	if (spi_flash_type < 0 || spi_flash_get_status(&status) < 0) {
+		return -1;
+	}
+	
+	return (status & SPI_FLASH_STATUS_BSY) ? 1 : 0;
+}
+
+#endif /* BOOTLOADER */
+
 #ifndef BOOTLOADER
 
 int spi_flash_program(uint32_t addr, uint8_t *buf, int len)
@@ -199,6 +285,15 @@ int spi_flash_program(uint32_t addr, uint8_t *buf, int len)
 
 #endif /* BOOTLOADER */
 
+int spi_flash_get_sector_size(void)
+{
+	if (spi_flash_type < 0) {
+		return -1;
+	}
+	
+	return spi_flash_table[spi_flash_type].sector_size;
+}
+
 int spi_flash_get_block_size(void)
 {
 	if (spi_flash_type < 0) {
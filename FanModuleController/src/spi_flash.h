@@ -11,8 +11,11 @@
 void spi_flash_init(void);
 int spi_flash_read(uint32_t addr, uint8_t *buf, int len);
 int spi_flash_erase(uint32_t addr, int len);
+int spi_flash_erase_sector_start(uint32_t addr);
+int spi_flash_busy(void);
 int spi_flash_program(uint32_t addr, uint8_t *buf, int len);
 int spi_flash_get_status(uint8_t *pstat);
+int spi_flash_get_sector_size(void);
 int spi_flash_get_block_size(void);
 void spi_flash_reset(void);
 
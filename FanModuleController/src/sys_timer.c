@@ -11,26 +11,79 @@
 #include "sys_timer.h"
 #include "uart.h"
 
-static uint32_t jiffies;
+static volatile uint32_t jiffies;
+static volatile uint32_t jiffies_hi;		/* Upper half of the 64-bit millisecond count */
+static uint32_t cycles_per_us;
 
 ISR(SysTick_Handler)
 {
-	jiffies++;
+	if (!++jiffies) {
+		jiffies_hi++;
+	}
 }
 
 void sys_timer_init(void)
 {
+	cycles_per_us = system_cpu_clock_get_hz() / 1000000;
 	SysTick_Config(system_cpu_clock_get_hz() / 1000);
 	PRINTF("System timer: %ld Hz\r\n", system_cpu_clock_get_hz());
 }
 
+/* Milliseconds since the system timer was started (wraps after ~49 days; use time_after() to compare) */
 uint32_t get_jiffies(void)
 {
-	uint32_t tmp;
+	/* An aligned 32-bit load is atomic: no locking needed */
+	return jiffies;
+}
+
+/*
+ * Take a consistent sample of the 64-bit millisecond count and of the
+ * microseconds elapsed in the current SysTick period, without masking
+ * interrupts: the counters are re-read if the SysTick handler ran meanwhile.
+ * Safe to call from interrupt context, where a SysTick wrap may still be pending.
+ */
+static uint64_t sys_timer_sample(uint32_t *sub_us)
+{
+	uint32_t hi, ms, val, wrapped;
+	
+	do {
+		hi = jiffies_hi;
+		ms = jiffies;
+		val = SysTick->VAL;
+		wrapped = 0;
+		if (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) {
+			/* Wrapped, but the handler could not run yet: re-read the reloaded counter */
+			val = SysTick->VAL;
+			wrapped = 1;
+		}
+	} while (ms != jiffies || hi != jiffies_hi);
 	
-	system_interrupt_enter_critical_section();
-	tmp = jiffies;
-	system_interrupt_leave_critical_section();
+	*sub_us = (SysTick->LOAD - val)/cycles_per_us;
+	
+	return (((uint64_t)hi << 32) | ms) + wrapped;
+}
+
+/* 64-bit millisecond count: never wraps */
+uint64_t get_jiffies64(void)
+{
+	uint32_t sub_us;
+	
+	return sys_timer_sample(&sub_us);
+}
+
+/* Microseconds since the system timer was started (wraps after ~71 minutes; use time_after() to compare) */
+uint32_t get_micros(void)
+{
+	uint32_t sub_us;
+	uint32_t ms = (uint32_t)sys_timer_sample(&sub_us);
+	
+	return ms*1000 + sub_us;
+}
+
+/* 64-bit microsecond time: never wraps */
+uint64_t get_time_us(void)
+{
+	uint32_t sub_us;
 	
-	return tmp;
+	return sys_timer_sample(&sub_us)*1000 + sub_us;
 }
\ No newline at end of file
@@ -9,7 +9,19 @@
 #ifndef __SYS_TIMER_H__
 #define __SYS_TIMER_H__
 
+/*
+ * Wrap-safe comparisons of 32-bit timestamps (jiffies or micros):
+ * valid as long as the two timestamps are less than half the range apart.
+ */
+#define time_after(a, b)		((int32_t)((b) - (a)) < 0)
+#define time_before(a, b)		time_after(b, a)
+#define time_after_eq(a, b)		((int32_t)((a) - (b)) >= 0)
+#define time_before_eq(a, b)	time_after_eq(b, a)
+
 void sys_timer_init(void);
 uint32_t get_jiffies(void);
+uint64_t get_jiffies64(void);
+uint32_t get_micros(void);
+uint64_t get_time_us(void);
 
 #endif /* __SYS_TIMER_H__ */
\ No newline at end of file
@@ -12,6 +12,7 @@
 #include "ring_buffer.h"
 #include "uart.h"
 #include "modbus.h"
+#include "sched.h"
 
 #define CFG_UART_CHANNEL(_chan, _sercom, _baud, _parity, _mux_setting, _pinmux_pad0, _pinmux_pad1, _pinmux_pad2, _pinmux_pad3) \
 { \
@@ -39,22 +40,30 @@ struct {
 
 #undef CFG_UART_CHANNEL
 #define CFG_UART_CHANNEL(_chan, ...) \
-	static RING_BUFFER(uart_ring_##_chan, CFG_UART_RING_SIZE);
+	static RING_BUFFER(uart_ring_##_chan, CFG_UART_RING_SIZE); \
+	static RING_BUFFER(uart_tx_ring_##_chan, CFG_UART_TX_RING_SIZE);
 
-/* UART input buffers (one for each defined channel) */
+/* UART input and output buffers (one of each for each defined channel) */
 CFG_UART_CHANNELS
 
 #undef CFG_UART_CHANNEL
 #define CFG_UART_CHANNEL(_chan, ...) \
 	{ \
 		(struct ring_buffer *)&uart_ring_##_chan, \
+		(struct ring_buffer *)&uart_tx_ring_##_chan, \
 	},
 
-/* Dynamic UART data (input buffer, USART instance, current input character) */
+/*
+ * Dynamic UART data (input/output buffers, USART instance, current input character,
+ * length of the output job in progress and transmit-complete callback)
+ */
 struct {
 	struct ring_buffer *ring;
+	struct ring_buffer *tx_ring;
 	struct usart_module usart_instance;
 	uint16_t current_char;
+	volatile int tx_len;
+	void (*tx_complete)(int chan);
 } uart_data[] = { CFG_UART_CHANNELS };
 
 #define UART_CHANNELS (int)(sizeof(uart_config)/sizeof(*uart_config))
@@ -89,6 +98,11 @@ static void uart_callback(struct usart_module *const mod)
 		modbus_receive((uint8_t)uart_data[chan].current_char);
 	} else {
 		ring_put(uart_data[chan].ring, uart_data[chan].current_char);
+#ifndef BOOTLOADER
+		if (chan == CFG_CONSOLE_CHANNEL) {
+			sched_wake(SCHED_CLI);
+		}
+#endif
 	}
 #else
 	/* Store the newly-received character in the input buffer */
@@ -98,6 +112,93 @@ static void uart_callback(struct usart_module *const mod)
 	usart_read_job((struct usart_module *const)mod, &uart_data[chan].current_char);
 }
 
+/*
+ * Start transmitting the next contiguous chunk of the output ring, unless a job is
+ * already in progress.  Must be called with interrupts disabled or from the UART ISR.
+ */
+static void uart_tx_start(int chan)
+{
+	struct ring_buffer *ring = uart_data[chan].tx_ring;
+	int head = ring->head, len;
+	
+	if (uart_data[chan].tx_len || head == ring->tail) {
+		return;
+	}
+	len = head > ring->tail ? head - ring->tail : ring->size - ring->tail;
+	uart_data[chan].tx_len = len;
+	usart_write_buffer_job(&uart_data[chan].usart_instance, &ring->data[ring->tail], len);
+}
+
+static void uart_tx_kick(int chan)
+{
+	system_interrupt_enter_critical_section();
+	uart_tx_start(chan);
+	system_interrupt_leave_critical_section();
+}
+
+/*
+ * UART callback: called by the ASF driver on TXC, i.e. when the last character of
+ * the current job has left the shift register.
+ */
+static void uart_tx_callback(struct usart_module *const mod)
+{
+	int chan = uart_find_channel(mod);
+	struct ring_buffer *ring;
+	
+	if (chan < 0) {
+		return;
+	}
+	ring = uart_data[chan].tx_ring;
+	ring->tail = (ring->tail + uart_data[chan].tx_len) % ring->size;
+	uart_data[chan].tx_len = 0;
+	if (ring->head != ring->tail) {
+		uart_tx_start(chan);
+	} else if (uart_data[chan].tx_complete) {
+		uart_data[chan].tx_complete(chan);
+	}
+}
+
+/* True when running in an exception handler or with interrupts masked (the TX ISR cannot run) */
+static int uart_cannot_wait(void)
+{
+	return __get_IPSR() != 0 || __get_PRIMASK() != 0;
+}
+
+/* printf() back-end for the console: queue instead of busy-waiting on the USART */
+static int uart_stdio_putchar(void volatile *base, char c)
+{
+	uart_putc(CFG_CONSOLE_CHANNEL, c);
+	
+	return 0;
+}
+
+/*
+ * Register a callback to be called (in interrupt context) once the output ring
+ * of a channel has drained and the last stop bit has been sent.
+ */
+void uart_set_tx_complete_callback(int chan, void (*func)(int chan))
+{
+	uart_data[chan].tx_complete = func;
+}
+
+int uart_tx_busy(int chan)
+{
+	struct ring_buffer *ring = uart_data[chan].tx_ring;
+	
+	return uart_data[chan].tx_len || ring->head != ring->tail;
+}
+
+/* Wait until all queued output of a channel has been sent */
+void uart_flush(int chan)
+{
+	if (uart_cannot_wait()) {
+		return;
+	}
+	while (uart_tx_busy(chan)) {
+		uart_tx_kick(chan);
+	}
+}
+
 int uart_gets(int chan, char *buf, int maxlen)
 {
 	struct ring_buffer *ring = uart_data[chan].ring;
@@ -110,18 +211,41 @@ int uart_gets(int chan, char *buf, int maxlen)
 	return ret;
 }
 
-#endif /* BOOTLOADER */
+/*
+ * Queue data for transmission: the output ring is drained by the USART interrupts,
+ * so this only waits if the ring is full.  When called from interrupt context,
+ * whatever does not fit in the ring is dropped.
+ */
+void uart_write(int chan, const uint8_t *buf, int len)
+{
+	struct ring_buffer *ring = uart_data[chan].tx_ring;
+	
+	while (len > 0) {
+		if (!ring_space(ring)) {
+			uart_tx_kick(chan);
+			if (uart_cannot_wait()) {
+				break;
+			}
+			continue;
+		}
+		ring_put(ring, *buf++);
+		len--;
+	}
+	uart_tx_kick(chan);
+}
 
 void uart_putc(int chan, char data)
 {
-	struct usart_module *mod = &uart_data[chan].usart_instance;
-	
-	usart_write_wait(mod, data);
+	uart_write(chan, (const uint8_t *)&data, 1);
 }
 
-void uart_puts(int chan, const char *str)
+#else /* BOOTLOADER */
+
+void uart_putc(int chan, char data)
 {
-	uart_write(chan, (const uint8_t *)str, strlen(str));
+	struct usart_module *mod = &uart_data[chan].usart_instance;
+	
+	usart_write_wait(mod, data);
 }
 
 void uart_write(int chan, const uint8_t *buf, int len)
@@ -131,6 +255,13 @@ void uart_write(int chan, const uint8_t *buf, int len)
 	usart_write_buffer_wait(mod, buf, len);
 }
 
+#endif /* BOOTLOADER */
+
+void uart_puts(int chan, const char *str)
+{
+	uart_write(chan, (const uint8_t *)str, strlen(str));
+}
+
 static void uart_init_channel(int chan, int baud)
 {
 	struct usart_config cfg;
@@ -150,8 +281,14 @@ static void uart_init_channel(int chan, int baud)
 	usart_enable(mod);
 	if (chan == CFG_CONSOLE_CHANNEL) {
 		stdio_serial_init(mod, uart_config[chan].sercom, &cfg);
+#ifndef BOOTLOADER
+		ptr_put = uart_stdio_putchar;
+#endif
 	}
 #ifndef BOOTLOADER
+	uart_data[chan].tx_len = 0;
+	usart_register_callback(mod, uart_tx_callback, USART_CALLBACK_BUFFER_TRANSMITTED);
+	usart_enable_callback(mod, USART_CALLBACK_BUFFER_TRANSMITTED);
 	usart_register_callback(mod, uart_callback, USART_CALLBACK_BUFFER_RECEIVED);
 	usart_enable_callback(mod, USART_CALLBACK_BUFFER_RECEIVED);
 	usart_read_job((struct usart_module *const)mod, &uart_data[chan].current_char);
@@ -171,6 +308,10 @@ int uart_init(void)
 
 void uart_set_baud_rate(int chan, int baud)
 {
+#ifndef BOOTLOADER
+	/* Let pending output go out at the old baud rate */
+	uart_flush(chan);
+#endif
 	uart_reset(chan);
 	uart_init_channel(chan, baud);
 }
@@ -26,5 +26,10 @@ void uart_write(int chan, const uint8_t *buf, int len);
 int uart_gets(int chan, char *buf, int maxlen);
 void uart_reset(int chan);
 void uart_set_baud_rate(int chan, int baud);
+#ifndef BOOTLOADER
+void uart_set_tx_complete_callback(int chan, void (*func)(int chan));
+int uart_tx_busy(int chan);
+void uart_flush(int chan);
+#endif
 
 #endif /* __UART_H__ */
\ No newline at end of file
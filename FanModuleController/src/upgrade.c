@@ -33,7 +33,8 @@ int upgrade_start(void)
 {
 	last_addr = 0;
 	flash_offset = spi_flash_get_block_size();
-	if (spi_flash_erase(0, -1) < 0) {
+	/* Keep the counter journal */
+	if (spi_flash_erase(0, CFG_JOURNAL_OFFSET) < 0) {
 		printf("ERROR: spi_flash_erase failed\r\n");
 		return -1;
 	}
@@ -88,6 +89,10 @@ int upgrade_parse_ihex(char *buf)
 		case 0:
 			/* Data */
 			addr -= CFG_FIRMWARE_START;
+			if (addr + flash_offset + len > CFG_JOURNAL_OFFSET) {
+				printf("ERROR: image too large\r\n");
+				return -1;
+			}
 			if (addr + len > last_addr) {
 				last_addr = addr + len;
 			}
@@ -115,6 +120,9 @@ int upgrade_parse_ihex(char *buf)
 int upgrade_write_data(uint32_t addr, uint8_t *buf, int len)
 {
 	addr -= CFG_FIRMWARE_START;
+	if (addr + flash_offset + len > CFG_JOURNAL_OFFSET) {
+		return -1;
+	}
 	if (addr + len > last_addr) {
 		last_addr = addr + len;
 	}
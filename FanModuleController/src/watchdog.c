@@ -14,7 +14,7 @@
 
 #include "watchdog.h"
 #include "sys_timer.h"
-#include "eeprom.h"
+#include "eeprom_driver.h"
 #include "uart.h"
 
 #if defined(CFG_WDT_TIMEOUT) && !defined(BOOTLOADER)
@@ -58,7 +58,7 @@ void wdt_init(uint32_t timeout_sec)
 
 ISR(WDT_Handler)
 {
-	eeprom_emulator_commit_page_buffer();
+	eeprom_commit_from_isr();
 	uart_puts(CFG_CONSOLE_CHANNEL, "WDT: EARLY WARNING HANDLER CALLED!\r\n");
 	WDT->INTFLAG.reg = WDT_INTFLAG_EW;
 }
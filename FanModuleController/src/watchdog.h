@@ -16,6 +16,7 @@
 #include "config.h"
 #include "watchdog.h"
 #include "eeprom.h"
+#include "uart.h"
 
 void wdt_disable(void);
 
@@ -40,8 +41,23 @@ void wdt_reset(void);
 
 #endif
 
+#ifndef BOOTLOADER
+#include "modbus.h"
+
+/* Console output is interrupt-driven: let it drain before resetting; save the pending holding registers */
+#define SYSTEM_RESET_FLUSH \
+	do { \
+		uart_flush(CFG_CONSOLE_CHANNEL); \
+		modbus_save_holding_regs(); \
+	} while (0)
+#else
+#define SYSTEM_RESET_FLUSH \
+	/* DO NOTHING */
+#endif
+
 #define SYSTEM_RESET \
 	do { \
+		SYSTEM_RESET_FLUSH; \
 		eeprom_emulator_commit_page_buffer(); \
 		while (1) { \
 			system_reset(); \
@@ -0,0 +1,15 @@
+/*
+ * asf.h: host build stand-in for the ASF header (host tests only)
+ *
+ * Created: 10/16/2026 9:41:08 PM
+ *  Author: E1210640
+ */ 
+
+#ifndef ASF_H_HOST_
+#define ASF_H_HOST_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#endif /* ASF_H_HOST_ */
\ No newline at end of file
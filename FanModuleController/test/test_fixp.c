@@ -0,0 +1,107 @@
+/*
+ * test_fixp.c: host test of the scaled-integer conversions (fixp.h)
+ *
+ * Created: 10/16/2026 9:41:08 PM
+ *  Author: E1210640
+ *
+ * Every raw sensor code is converted with the calibration constants of
+ * config.h and compared with the float expressions the firmware used
+ * before, and with the exact rational value. Build and run with "make".
+ */ 
+
+#include <asf.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "config.h"
+#include "fixp.h"
+
+static int failures;
+
+/* Exact value truncated towards zero, in 64 bits */
+static int32_t exact(uint16_t raw, int32_t num, int32_t den, int32_t offset)
+{
+	return (int32_t)(((int64_t)raw * num + (int64_t)offset * den) / den);
+}
+
+/* Compare one conversion over all raw codes: differences to the float reference must not exceed max_diff */
+static void check(const char *name, int32_t (*reference)(uint16_t), int32_t num, int32_t den, int32_t offset, int max_diff)
+{
+	uint32_t raw;
+	int32_t val, ref;
+	int diffs = 0, worst = 0;
+	
+	for (raw = 0; raw <= 0xFFFF; raw++) {
+		val = fixp_convert(raw, num, den, offset);
+		if (val != exact(raw, num, den, offset)) {
+			printf("%s: raw %lu: %ld, exact %ld\n", name, (unsigned long)raw, (long)val, (long)exact(raw, num, den, offset));
+			failures++;
+		}
+		ref = reference(raw);
+		if (val != ref) {
+			diffs++;
+			if (abs(val - ref) > worst) {
+				worst = abs(val - ref);
+			}
+		}
+	}
+	printf("%-12s %5d codes differ from float, by at most %d LSB (bound %d)\n", name, diffs, worst, max_diff);
+	if (worst > max_diff) {
+		failures++;
+	}
+}
+
+/* The float expressions replaced by fixp_convert() */
+static int32_t ref_current(uint16_t raw)
+{
+	return (int32_t)(1000 * ((float)raw) * 0.0000025 / 0.001);
+}
+
+static int32_t ref_voltage(uint16_t raw)
+{
+	return (int32_t)(1000 * ((float)raw) * 0.00125 / 0.2130);
+}
+
+static int32_t ref_temperature(uint16_t raw)
+{
+	return (int32_t)(100*(-45+175*((float)raw)/(65536-1)));
+}
+
+static int32_t ref_humidity(uint16_t raw)
+{
+	return (int32_t)(100*100*((float)raw)/(65536-1));
+}
+
+/* fixp_percent() against the float RPM deviation over a grid of speeds and curve values */
+static void check_percent(void)
+{
+	uint32_t num, den;
+	uint16_t val, ref;
+	int diffs = 0;
+	
+	for (den = 0; den <= 20000; den += 7) {
+		for (num = 0; num <= 20000; num += 13) {
+			val = fixp_percent(num, den);
+			ref = den ? (uint16_t)(100 * (float)num / (float)den) : 0;
+			if (val != (uint16_t)(den ? 100 * num / den : 0)) {
+				failures++;
+			}
+			if (val != ref) {
+				diffs++;
+			}
+		}
+	}
+	printf("%-12s %5d grid points differ from float (exact truncation checked)\n", "percent", diffs);
+}
+
+int main(void)
+{
+	check("current", ref_current, CFG_INA226_CURRENT_NUM, CFG_INA226_CURRENT_DEN, 0, 0);
+	check("voltage", ref_voltage, CFG_INA226_VOLTAGE_NUM, CFG_INA226_VOLTAGE_DEN, 0, 0);
+	check("temperature", ref_temperature, CFG_SHT31_TEMP_NUM, CFG_SHT31_TEMP_DEN, CFG_SHT31_TEMP_OFFSET, 1);
+	check("humidity", ref_humidity, CFG_SHT31_HUM_NUM, CFG_SHT31_HUM_DEN, 0, 1);
+	check_percent();
+	printf("%s\n", failures ? "FAILED" : "OK");
+	
+	return failures ? 1 : 0;
+}
\ No newline at end of file
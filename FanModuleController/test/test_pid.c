@@ -0,0 +1,151 @@
+/*
+ * test_pid.c: host test of the fixed-point PID controller (pid.c)
+ *
+ * Created: 10/16/2026 10:58:14 PM
+ *  Author: E1210640
+ *
+ * The controller runs every CFG_FAN_TASK_PERIOD against a first-order
+ * fan model: the speed approaches curve(PWM) x ageing with the time
+ * constant tau. The model state is Q16 RPM, so that it converges to the
+ * setpoint instead of stalling on integer truncation at small errors.
+ * Build and run with "make".
+ */ 
+
+#include <asf.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "config.h"
+#include "pid.h"
+
+#define RPM_PER_PERCENT		30			/* Test curve: linear, 3000 RPM at 100 % PWM */
+#define AGEING_PERCENT		80			/* The fan only reaches 80 % of its curve */
+#define TAU_MS				2000
+#define DT_MS				CFG_FAN_TASK_PERIOD
+
+/* First-order fan model */
+struct plant {
+	int64_t rpm_q16;
+};
+
+static int failures;
+
+static int32_t plant_rpm(const struct plant *plant)
+{
+	return (int32_t)((plant->rpm_q16 + 0x8000) >> 16);
+}
+
+static void plant_step(struct plant *plant, int32_t pwm_q16)
+{
+	int64_t target_q16 = (int64_t)pwm_q16 * RPM_PER_PERCENT * AGEING_PERCENT / 100;
+	
+	plant->rpm_q16 += (target_q16 - plant->rpm_q16) * DT_MS / (TAU_MS + DT_MS);
+}
+
+/* Feed-forward from the (unaged) curve, as curve_pwm() gives it */
+static int32_t feed_forward(int32_t rpm)
+{
+	return PID_Q16(rpm) / RPM_PER_PERCENT;
+}
+
+static void pid_setup(struct pid *pid)
+{
+	pid_init(pid, CFG_MODBUS_HLD_FAN_PID_KP, CFG_MODBUS_HLD_FAN_PID_KI, CFG_MODBUS_HLD_FAN_PID_KD,
+		PID_Q16(CFG_MODBUS_HLD_FAN_REUEST_MIN), PID_Q16(CFG_MODBUS_HLD_FAN_REUEST_MAX));
+}
+
+/* Run the loop for ms; returns the time within 2 % of the setpoint for good (-1: never), tracks the peak */
+static int32_t run(struct pid *pid, struct plant *plant, int32_t rpm_request, int32_t ms, int32_t *peak)
+{
+	int32_t t, out, rpm, settled = -1;
+	
+	for (t = 0; t < ms; t += DT_MS) {
+		rpm = plant_rpm(plant);
+		out = pid_update(pid, rpm_request, rpm, feed_forward(rpm_request), DT_MS);
+		if (out < pid->out_min || out > pid->out_max) {
+			printf("output %ld outside its limits\n", (long)out);
+			failures++;
+		}
+		plant_step(plant, out);
+		rpm = plant_rpm(plant);
+		if (peak && rpm > *peak) {
+			*peak = rpm;
+		}
+		if (abs(rpm - rpm_request) * 50 > rpm_request) {
+			settled = -1;
+		} else if (settled < 0) {
+			settled = t + DT_MS;
+		}
+	}
+	
+	return settled;
+}
+
+/* Step from standstill: settles within 2 % in 15 s, overshoot below 25 %, no steady-state error */
+static void test_step_response(void)
+{
+	struct pid pid;
+	struct plant plant = { 0 };
+	int32_t settled, peak = 0, rpm_request = 1500;
+	
+	pid_setup(&pid);
+	pid_reset(&pid, rpm_request, 0, feed_forward(rpm_request), feed_forward(rpm_request));
+	settled = run(&pid, &plant, rpm_request, 60000, &peak);
+	printf("step:       settled after %ld ms, peak %ld RPM, final %ld RPM\n", (long)settled, (long)peak, (long)plant_rpm(&plant));
+	if (settled < 0 || settled > 15000 || peak > rpm_request * 125 / 100 || abs(plant_rpm(&plant) - rpm_request) > 1) {
+		failures++;
+	}
+}
+
+/* Unreachable setpoint: the integral must not wind up, so the step back down recovers at once */
+static void test_anti_windup(void)
+{
+	struct pid pid;
+	struct plant plant = { 0 };
+	int32_t settled, out, integral, rpm_request = 1500;
+	
+	pid_setup(&pid);
+	pid_reset(&pid, 3500, 0, feed_forward(3500), pid.out_max);
+	run(&pid, &plant, 3500, 10000, NULL);
+	integral = pid.integral;
+	run(&pid, &plant, 3500, 20000, NULL);
+	if (pid.integral != integral) {
+		printf("windup:     the integral kept growing while saturated (%ld -> %ld)\n", (long)integral, (long)pid.integral);
+		failures++;
+	}
+	out = pid_update(&pid, rpm_request, plant_rpm(&plant), feed_forward(rpm_request), DT_MS);
+	settled = run(&pid, &plant, rpm_request, 60000, NULL);
+	printf("windup:     integral %ld after 30 s saturated, first output %ld%%, settled after %ld ms\n",
+		(long)pid.integral, (long)(out >> 16), (long)settled);
+	if (out >= pid.out_max || settled < 0 || settled > 15000) {
+		failures++;
+	}
+}
+
+/* Bumpless transfer: the first update continues from the open-loop PWM (only the integral step differs) */
+static void test_bumpless(void)
+{
+	struct pid pid;
+	struct plant plant = { PID_Q16(50) * (int64_t)RPM_PER_PERCENT * AGEING_PERCENT / 100 };
+	int32_t out, rpm, rpm_request = 1500, expected;
+	
+	pid_setup(&pid);
+	rpm = plant_rpm(&plant);
+	pid_reset(&pid, rpm_request, rpm, feed_forward(rpm_request), PID_Q16(50));
+	out = pid_update(&pid, rpm_request, rpm, feed_forward(rpm_request), DT_MS);
+	expected = PID_Q16(50) + (int64_t)pid.ki * (rpm_request - rpm) * DT_MS / 1000;
+	printf("bumpless:   50%% open loop -> %ld/65536 %% (expected %ld/65536)\n", (long)out, (long)expected);
+	if (abs(out - expected) > 1) {
+		failures++;
+	}
+}
+
+int main(void)
+{
+	test_step_response();
+	test_anti_windup();
+	test_bumpless();
+	printf("%s\n", failures ? "FAILED" : "OK");
+	
+	return failures ? 1 : 0;
+}
\ No newline at end of file